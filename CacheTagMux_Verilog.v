@@ -0,0 +1,50 @@
+///////////////////////////////////////////////////////////////////////////////////////
+// Tag read back for the cache controller
+//
+// The cache controller needs the epoch and tag stored in the block it is replacing (the write back
+// address of a dirty victim, and whether the victim is from the current epoch). Each AssociativeCache_Set
+// brings its stored tag out on TagDataOut, and this selects the one the controller asks for with
+// CacheWaySelect_H, the same one hot select that drives CacheDataMux. With no select (or more than one,
+// which the controller never does) the outputs are or'ed together.
+//
+// TagWidth is the controller's EpochBits + TagBits (4 + 21 for the default 8 x 128 x 8 geometry)
+///////////////////////////////////////////////////////////////////////////////////////
+
+
+module CacheTagMux_Verilog #(
+		parameter TagWidth = 25
+	)
+	(
+		input unsigned [7:0] WaySelect_H,								// one hot, from the cache controller's CacheWaySelect_H
+		input unsigned [TagWidth-1:0] Block0_TagIn,					// TagDataOut of each block's AssociativeCache_Set
+		input unsigned [TagWidth-1:0] Block1_TagIn,
+		input unsigned [TagWidth-1:0] Block2_TagIn,
+		input unsigned [TagWidth-1:0] Block3_TagIn,
+		input unsigned [TagWidth-1:0] Block4_TagIn,
+		input unsigned [TagWidth-1:0] Block5_TagIn,
+		input unsigned [TagWidth-1:0] Block6_TagIn,
+		input unsigned [TagWidth-1:0] Block7_TagIn,
+		output reg unsigned [TagWidth-1:0] TagOut					// to the cache controller's TagDataInFromCache
+	);
+
+	always@(*)
+	begin
+		TagOut = 0;
+		if(WaySelect_H[0] == 1)
+			TagOut = TagOut | Block0_TagIn;
+		if(WaySelect_H[1] == 1)
+			TagOut = TagOut | Block1_TagIn;
+		if(WaySelect_H[2] == 1)
+			TagOut = TagOut | Block2_TagIn;
+		if(WaySelect_H[3] == 1)
+			TagOut = TagOut | Block3_TagIn;
+		if(WaySelect_H[4] == 1)
+			TagOut = TagOut | Block4_TagIn;
+		if(WaySelect_H[5] == 1)
+			TagOut = TagOut | Block5_TagIn;
+		if(WaySelect_H[6] == 1)
+			TagOut = TagOut | Block6_TagIn;
+		if(WaySelect_H[7] == 1)
+			TagOut = TagOut | Block7_TagIn;
+	end
+endmodule
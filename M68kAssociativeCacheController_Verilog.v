@@ -4,11 +4,70 @@
 // designed to work with TG68 (68000 based) cpu with 16 bit data bus and 32 bit address bus
 // separate upper and lowe data stobes for individual byte and also 16 bit word access
 //
+// Options are set by the parameters below (on the symbol in the schematic). Geometry is Ways x Sets x
+// LineWords (default 8 x 128 x 8 words = 16K bytes): the schematic needs one AssociativeCache_Set per way
+// of Sets lines, tag memories EpochBits wider than the tag with the stored tag read back through
+// CacheTagMux_Verilog, a PseudoLRU_Bits memory Sets deep by StateBits, and LineWords must be the Dram
+// controller's burst length. CacheWaySelect_H selects the block for both CacheDataMux and CacheTagMux.
+//
+// Replacement (StateBits of state per set): 0 = tree pseudo LRU, node n's children are bits 2n+1 (lower
+// ways) and 2n+2, 1 = true LRU ages, 2 = random (LFSR), 3 = SRRIP. A miss only replaces a way allowed by
+// its class's way mask (program, data or supervisor by FC, 0 or all ones = any) and not in LockedWays.
+//
+// Invalidation is by epoch: tags are stored with Epoch and only the current Epoch hits. Epoch and
+// LockedWays have no reset (power up 0). A reset or invalidate everything moves Epoch on, InvalidateCache
+// sweeps the sets only when Epoch wraps or, keeping Epoch, when any way is locked.
+//
+// SnoopCycle_H marks a DMA controller cycle: reads are served from the cache or bypass it, writes
+// invalidate (write through) or update (write back hit) the cached line, misses never allocate.
+// A refresh is tracked from RAS and CAS low together to keep prefetches and drains out of its way,
+// but a miss that meets one waits for it.
+//
+// Cache registers at 0x00409000 (CacheRegSelect_H), 16 bits, 32 bit counters read upper word first:
+//		00 ReadHits		04 ReadMisses		08 Writes				0C WriteInvalidations
+//		10 BurstFillCycles	14 StallCycles	18 RefreshCollisions	1C WriteBufferFullStalls
+//		20 PrefetchHits	24 PrefetchUseless	28 WriteUpdates		2C UncachedReads
+//		80 VictimHits		84 VictimCaptures	88 RefreshStallCycles
+//		30 CacheControl (bit 0 = prefetch)	32 CounterReset (write)
+//		34 Ways, 36 Sets, 38 LineWords (read only)
+//		3A CodeWayMask, 3C DataWayMask, 3E SupervisorWayMask
+//		40 CacheCommandAddress (long), 44 CacheCommandLines, 46 CacheCommand: 1 = invalidate all,
+//		   2 = invalidate lines, 3 = flush lines (read bit 0 = busy)
+//		48 LockedWays (all ones locks all but the top way, so never every way)
+//		60 + 8n UncachedBase n (long, bit 0 = enable), 64 + 8n UncachedMask n (long): Dram addresses with
+//		   (address ^ base) & mask == 0 bypass the cache
+//
 // Copyright PJ Davies August 2017
 ///////////////////////////////////////////////////////////////////////////////////////
 
 
-module M68kAssociativeCacheController_Verilog (
+module M68kAssociativeCacheController_Verilog #(
+		parameter WriteBackMode = 0,										// 0 = write through (write hits invalidate), 1 = write back with write allocate and dirty bits
+		parameter CriticalWordFirst = 1,										// 1 = start the burst at the word the 68k asked for (needs the Dram controller's 8 word burst to wrap)
+		parameter FastHitMode = 1,												// 1 = read hits get dtack in Idle, LRU bits written the clock after
+		parameter WriteHitUpdate = 1,											// write through only: 1 = a write hit updates the cached word, 0 = it invalidates the block
+		parameter WriteBufferDepth = 4,										// 1-8 entry posted write buffer for write through writes, 0 = 68k waits for each Dram write
+		parameter Ways = 8,														// blocks per set: 2, 4, 8 or 16
+		parameter Sets = 128,													// lines per block: a power of 2 from 2 to 1024
+		parameter LineWords = 8,												// 16 bit words per line: 4, 8 or 16 (the Dram controller's burst length)
+		parameter EpochBits = 4,												// invalidate everything 2**EpochBits - 1 times between InvalidateCache sweeps
+		parameter UncachedRegions = 2,										// 0-4 base/mask register pairs for uncached Dram regions
+		parameter VictimEntries = 0,											// 0 = no victim buffer, 1-8 lines
+		parameter CodeWayMask = 16'hFFFF,									// way mask register values after reset
+		parameter DataWayMask = 16'hFFFF,
+		parameter SupervisorWayMask = 16'hFFFF,
+		parameter ReplacementPolicy = 0,										// 0 = tree pseudo LRU, 1 = true LRU, 2 = random, 3 = SRRIP (see above)
+		parameter RefreshGuardClocks = 24,									// no new prefetch or drain this close to an expected refresh, 0 = off
+		parameter RefreshBusyClocks = 10,									// longest a refresh holds the Dram controller
+
+		// derived from the above, do not set these on the symbol
+		parameter WayBits = (Ways > 8) ? 4 : (Ways > 4) ? 3 : (Ways > 2) ? 2 : 1,
+		parameter IndexBits = (Sets > 512) ? 10 : (Sets > 256) ? 9 : (Sets > 128) ? 8 : (Sets > 64) ? 7 : (Sets > 32) ? 6 :
+									 (Sets > 16) ? 5 : (Sets > 8) ? 4 : (Sets > 4) ? 3 : (Sets > 2) ? 2 : 1,
+		parameter WordBits = (LineWords > 8) ? 4 : (LineWords > 4) ? 3 : 2,
+		parameter TagBits = 31 - IndexBits - WordBits,
+		parameter StateBits = (ReplacementPolicy == 1) ? Ways * WayBits : (ReplacementPolicy == 2) ? 1 : (ReplacementPolicy == 3) ? 2 * Ways : Ways - 1
+	) (
 		input Clock,															// used to drive the state machine - state changes occur on positive edge
 		input Reset_L,    													// active low reset 
 
@@ -22,6 +81,8 @@ module M68kAssociativeCacheController_Verilog (
 		input LDS_L,	   													// active low signal driven by 68000 when 68000 transferring data over data bit 7-0
 		input WE_L, 															// active low write signal, otherwise assumed to be read
 		input AS_L,									
+		input unsigned [2:0] FC,												// function code from the TG68, says if this is a program fetch and if it is supervisor
+		input SnoopCycle_H,													// bus cycle is from the DMA controller, not the 68k (see top)
 		input DtackFromDram_L,												// dtack back from Dram
 		input CAS_Dram_L,														// cas to Dram so we can count 2 clock delays before 1st data
 		input RAS_Dram_L,														// so we can detect difference between a read and a refresh command
@@ -29,6 +90,9 @@ module M68kAssociativeCacheController_Verilog (
 		input unsigned [15:0] DataBusInFromDram, 						// data bus in from Dram
 		output reg unsigned [15:0] DataBusOutToDramController,	// data bus out to Dram (during write)
 		input unsigned [15:0] DataBusInFromCache,						// data bus in from Cache
+		output reg unsigned [15:0] DataBusOutToCache,				// data bus out to Cache (Dram data during burst fill, 68k data for a write back write)
+		output reg unsigned [Ways-1:0] CacheWaySelect_H,					// selects the block driving DataBusInFromCache and TagDataInFromCache (normally the hit block)
+		input unsigned [EpochBits+TagBits-1:0] TagDataInFromCache,		// epoch and tag stored in the block selected by CacheWaySelect_H (write back eviction address)
 		
 		output reg UDS_DramController_L,									// active low signal driven by 68000 when 68000 transferring data over data bit 7-0
 		output reg LDS_DramController_L,									// active low signal driven by 68000 when 68000 transferring data over data bit 15-8
@@ -38,22 +102,27 @@ module M68kAssociativeCacheController_Verilog (
 		output reg DtackTo68k_L,											// Dtack back to 68k at end of operation
 		
 		// Cache memory write signals
-		output reg unsigned [7:0] TagCache_WE_L,						// 8 bits for 8 blocks to store an address in Cache
-		output reg unsigned [7:0] DataCache_WE_L,						// 8 bits for 8 blocks to store data in Cache
-		output reg unsigned [7:0] ValidBit_WE_L,						// 8 bits for 8 blocks to store a valid bit
+		output reg unsigned [Ways-1:0] TagCache_WE_L,				// 1 bit per block to store an address in Cache
+		output reg unsigned [Ways-1:0] DataCache_WE_L,				// 1 bit per block to store data in Cache
+		output reg unsigned [Ways-1:0] ValidBit_WE_L,				// 1 bit per block to store a valid bit
 		
 		output reg unsigned [31:0] AddressBusOutToDramController,	// address bus from Cache to Dram controller
-		output reg unsigned [20:0] TagDataOut,								// 21 bit address to store in the tag Cache
-		output reg unsigned [2:0] WordAddress,								// upto 8 words in a Cache line
+		output reg unsigned [EpochBits+TagBits-1:0] TagDataOut,		// epoch and address to store in the tag Cache (4 + 21 bits for the default geometry)
+		output reg unsigned [WordBits-1:0] WordAddress,				// word within a Cache line
 		output reg ValidBitOut_H,												// indicates the cache line is valid
-		output reg unsigned [6:0] Index,										// 3 bit Line for 8 
+		output reg unsigned [IndexBits-1:0] Index,						// line (set) number
 	
-		input unsigned [7:0] ValidHit_H,									// indicates if any block in valid and a hit for the set
-		input unsigned [7:0] Valid_H,										// indicates if any block in valid
-		input unsigned [6:0] LRUBits_In,	
-		output reg unsigned [6:0] LRUBits_Out,	
+		input unsigned [Ways-1:0] ValidHit_H,							// indicates if any block in valid and a hit for the set
+		input unsigned [Ways-1:0] Valid_H,								// indicates if any block in valid
+		input unsigned [StateBits-1:0] LRUBits_In,					// replacement state for the set (pseudo LRU bits by default)
+		output reg unsigned [StateBits-1:0] LRUBits_Out,	
 		output reg LRU_WE_L,
 
+		// cache control and performance counter registers
+		input CacheRegSelect_H,												// active high when 68000 is addressing the cache registers (address decoder)
+		output reg unsigned [15:0] CacheRegDataOut,					// register data back to 68000 (during read)
+		output CacheRegDtack_L,												// Dtack back to 68k for a register access
+
 		// debugging only
 		output unsigned [4:0] CacheState	
 	);
@@ -74,28 +143,413 @@ module M68kAssociativeCacheController_Verilog (
 	parameter	EndBurstFill 					= 5'b01000;
 	parameter	WriteDataToDram 				= 5'b01001;
 	parameter	WaitForEndOfCacheRead		= 5'b01010;
+	parameter	WriteDataToCache				= 5'b01011;								// write back mode only
+	parameter	WriteBackDirtyWord			= 5'b01100;								// write back mode only
+	parameter	EndWriteBackDirtyWord		= 5'b01101;								// write back mode only
+	parameter	FastHitUpdateLRU				= 5'b01110;								// fast hit mode only
+	parameter	CopyStreamBufferIntoCache	= 5'b01111;
+	parameter	CacheCommandLine				= 5'b10000;
+	parameter	UncachedRead					= 5'b10001;
+	parameter	UncachedBurst					= 5'b10010;
+	parameter	UncachedEnd						= 5'b10011;
+	parameter	CopyVictimIntoCache			= 5'b10100;
 	
-	// 5 bit variables to hold current and next state of the state machine
-	reg unsigned [4:0] CurrentState;					// holds the current state of the Cache controller
-	reg unsigned [4:0] NextState; 						// holds the next state of the Cache controller
+	// the state machine is one hot: bit n of StateOneHot is state n above, and the next state logic sets
+	// NextState's bits directly (a state's flop is the OR of the ways into that state)
+	reg unsigned [4:0] CurrentState;					// encoded from StateOneHot, for CacheState only
+	reg unsigned [20:0] NextState; 						// holds the next state of the Cache controller, one hot
+	reg unsigned [20:0] StateOneHot;					// holds the current state of the Cache controller, one hot
+	integer StateNumber;
 	
+	// address bit positions for the chosen geometry: word is [WordBits:1], index [TagLow-1:LineLow], tag [31:TagLow]
+	localparam LineLow = WordBits + 1;
+	localparam TagLow = WordBits + IndexBits + 1;
+
 	// counter for the read burst fill
-	reg unsigned [15:0] BurstCounter;					// counts for at least 8 during a burst Dram read also counts lines when flusing the cache
+	reg unsigned [15:0] BurstCounter;					// counts for at least LineWords during a burst Dram read also counts lines when flusing the cache
 	reg BurstCounterReset_L;								// reset for the above counter
 	
 	// 2 bit register to hold the block number and a signla to store it 
-	reg unsigned [2:0] ReplaceBlockNumber;				// register to hold the number of the block/way where new cache data will be loaded
-	reg unsigned [2:0] ReplaceBlockNumberData;		// data to store in the above register
+	reg unsigned [WayBits-1:0] ReplaceBlockNumber;				// register to hold the number of the block/way where new cache data will be loaded
+	reg unsigned [WayBits-1:0] ReplaceBlockNumberData;		// data to store in the above register
 	reg LoadReplacementBlockNumber_H;					// signal to load the replceblocknumber with the new data above
 	
 	// signals for the least recently used bits utilised in cache replacement policy
 	reg  LRUBits_Load_H;
-	reg  unsigned [6:0]  LRUBits;
+	reg  unsigned [StateBits-1:0]  LRUBits;
+
+	// set and block of a fast read hit, held so the LRU bits can be written the clock after the hit
+	reg unsigned [IndexBits-1:0] LRUUpdateIndex;
+	reg unsigned [WayBits-1:0] LRUUpdateBlockNumber;
+	reg LoadLRUUpdate_H;
+
+	// posted write buffer, a circular buffer of up to 8 entries, each entry valid from push until the Dram write completes
+	reg unsigned [31:0] WriteBufferAddress [0:7];
+	reg unsigned [15:0] WriteBufferData [0:7];
+	reg unsigned [7:0] WriteBufferUDS_L;
+	reg unsigned [7:0] WriteBufferLDS_L;
+	reg unsigned [7:0] WriteBufferValid;
+	reg unsigned [2:0] WriteBufferHead;					// oldest entry, next to be written to Dram
+	reg unsigned [2:0] WriteBufferTail;					// next free entry
+	reg WriteBufferPush_H;									// store the 68k's write at the tail
+	reg WriteBufferPop_H;									// head entry has been written to Dram
+	reg WriteBufferFullStall_H;							// 68k write waiting because buffer is full
+	wire WriteBufferFull_H;
+	wire WriteBufferEmpty_H;
+	reg LineInWriteBuffer_H;								// a buffered write is to the line in FillAddress
+	integer i;
+
+	// write buffer drain state machine, runs alongside the main state machine and uses the Dram controller when that is not
+	parameter	DrainIdle						= 2'b00;
+	parameter	DrainWrite						= 2'b01;
+	parameter	DrainEndWrite					= 2'b10;
+	reg unsigned [1:0] DrainState;
+	reg DramBusyForMain_H;									// main state machine is using (or about to use) the Dram controller this clock
+
+	// next line prefetch state machine, runs alongside the main state machine and reads a line from Dram into the 
+	// stream buffer when neither the main state machine nor the write buffer drain is using the Dram controller
+	parameter	PrefetchIdle					= 3'b000;
+	parameter	PrefetchRead					= 3'b001;
+	parameter	PrefetchCASDelay1				= 3'b010;
+	parameter	PrefetchCASDelay2				= 3'b011;
+	parameter	PrefetchBurst					= 3'b100;
+	parameter	PrefetchEnd						= 3'b101;
+	reg unsigned [2:0] PrefetchState;
+	reg unsigned [WordBits-1:0] PrefetchCounter;					// word of the stream buffer being loaded
+	reg PrefetchPending_H;									// a prefetch has been asked for but not started
+	reg unsigned [31:LineLow] PrefetchPendingLine;
+	reg unsigned [31:LineLow] PrefetchLine;					// line being prefetched
+	reg PrefetchCancel_H;									// line being prefetched was written while in flight, throw it away
+	wire PrefetchStart_H;
+
+	reg unsigned [15:0] StreamBuffer [0:LineWords-1];
+	reg unsigned [31:LineLow] StreamBufferLine;				// line held in the stream buffer
+	reg StreamBufferValid_H;
+	wire StreamBufferDiscard_H;							// stream buffer line is being thrown away unused
+	wire PrefetchLineWritten_H;							// line being prefetched is being written by the 68k or a write back
+
+	// requests from the main state machine
+	reg PrefetchRequest_H;									// ask for a prefetch of PrefetchRequestLine
+	reg unsigned [31:LineLow] PrefetchRequestLine;
+	reg StreamBufferConsume_H;								// stream buffer line is being copied into the cache
+	reg StreamBufferInvalidate_H;							// StreamBufferInvalidateLine is being written to Dram
+	reg unsigned [31:LineLow] StreamBufferInvalidateLine;
+
+	// performance counters (see register map at the top)
+	reg unsigned [31:0] ReadHits;
+	reg unsigned [31:0] ReadMisses;
+	reg unsigned [31:0] Writes;
+	reg unsigned [31:0] WriteInvalidations;
+	reg unsigned [31:0] BurstFillCycles;
+	reg unsigned [31:0] StallCycles;
+	reg unsigned [31:0] RefreshCollisions;
+	reg unsigned [31:0] WriteBufferFullStalls;		// clocks a 68k write has waited for a free write buffer entry
+	reg unsigned [31:0] PrefetchHits;					// misses satisfied from the stream buffer
+	reg unsigned [31:0] PrefetchUseless;				// prefetched lines thrown away without being used
+	reg unsigned [31:0] WriteUpdates;
+	reg unsigned [31:0] UncachedReads;
+	reg unsigned [31:0] VictimHits;
+	reg unsigned [31:0] VictimCaptures;
+	reg unsigned [31:0] RefreshStallCycles;
 
+	// events from the next state logic for the counters
+	reg CountReadHit_H;
+	reg CountReadMiss_H;
+	reg CountWrite_H;
+	reg CountWriteInvalidate_H;
+	reg CountWriteUpdate_H;
+	reg CountUncachedRead_H;
+	reg CountVictimHit_H;
+	reg CountBurstFillCycle_H;
+	reg unsigned [10:0] CountStrobes;						// the above (and the stall conditions) a clock later, see Count strobes
+	reg RefreshSeen_H;										// refresh (RAS and CAS low) seen last clock, to count each refresh once
+
+	// refresh tracking
+	reg unsigned [15:0] RefreshAge;						// clocks since the last refresh, sticks at FFFF
+	reg unsigned [15:0] RefreshPeriod;					// clocks between the last two refreshes, 0 = not known yet
+	reg RefreshBusy_H;										// a refresh is (probably) still holding the Dram controller
+	wire RefreshSoon_H;										// next refresh due within RefreshGuardClocks
+	wire DrainAllowed_H;										// write buffer drain may start a Dram write
+
+	// cache registers
+	reg unsigned [15:0] CacheControl;
+	reg unsigned [15:0] CounterLowWord;					// lower half of a counter, frozen when its upper half is read
+	wire CacheRegWrite_H;
+	wire CacheRegRead_H;
+	wire CounterClear_H;
+	wire PrefetchEnable_H;
+	reg unsigned [Ways-1:0] CodeWays;					// way mask registers (see top)
+	reg unsigned [Ways-1:0] DataWays;
+	reg unsigned [Ways-1:0] SupervisorWays;
+	reg unsigned [Ways-1:0] LockedWays = 0;			// ways never replaced or invalidated by invalidate everything or a reset (see top)
+	wire unsigned [Ways-1:0] ClassWays_H;				// way mask for the 68k's current access
+	wire unsigned [Ways-1:0] ReplaceAllowed_H;		// blocks the 68k's current access may replace
+	wire HitUpdate_H;											// a write through write hit updates the cached word (WriteHitUpdate, not for the DMA)
+	wire Bypass_H;												// access goes straight to Dram: uncached region, or a DMA access the cache does not have
+
+	// replacement policies (see top)
+	localparam PLRUPolicy = 0;
+	localparam LRUPolicy = 1;
+	localparam RandomPolicy = 2;
+	localparam SRRIPPolicy = 3;
+	localparam FieldBits = (ReplacementPolicy == SRRIPPolicy) ? 2 : WayBits;		// per block state for LRU and SRRIP
+	reg unsigned [15:0] RandomBits;						// LFSR for random replacement
+	reg unsigned [WayBits-1:0] ReplacementChoice;		// block a miss by the 68k's current access would replace, picked in Idle
+
+	// dirty bits for write back mode, one per block in each set
+	reg unsigned [Ways-1:0] DirtyBits [0:Sets-1];
+	reg DirtyBit_WE_H;										// write the dirty bits selected by DirtyBitBlockMask in set 'Index'
+	reg DirtyBitOut_H;										// value to write (1 = dirty, 0 = clean)
+	reg unsigned [Ways-1:0] DirtyBitBlockMask;				// which block(s) to write
+	wire VictimDirty_H;										// block chosen for replacement holds modified data
+	reg unsigned [Ways-1:0] ReplaceBlockMask;				// one hot version of ReplaceBlockNumber, loaded with it
+
+	// address of the line being filled, latched on the miss so the 68k is free to move on while the burst completes
+	reg unsigned [31:0] FillAddress;
+	reg unsigned [31:0] FillAddressData;				// address to latch, the 68k's or a line being flushed
+	reg LoadFillAddress_H;
+
+	// epoch the current cache contents were written in, deliberately not reset (see top)
+	reg unsigned [EpochBits-1:0] Epoch = 0;
+	reg EpochIncrement_H;
+	wire VictimCurrent_H;									// block chosen for replacement was written in this epoch
+
+	// software invalidate/flush commands
+	parameter	InvalidateAllCommand			= 2'b01;
+	parameter	InvalidateLinesCommand		= 2'b10;
+	parameter	FlushLinesCommand				= 2'b11;
+	reg unsigned [1:0] CacheCommand;
+	reg unsigned [31:0] CacheCommandAddress;
+	reg unsigned [15:0] CacheCommandLines;
+	reg CacheCommandBusy_H;									// written but not finished yet
+	reg CacheRegWriteSeen_H;								// 68k register write already going on last clock
+	reg CacheCommandNextLine_H;							// this line is done, move on to the next
+	reg CacheCommandDone_H;
+	reg StreamBufferFlush_H;								// throw away the stream buffer and anything being prefetched
+
+	// uncached regions, a 68k address matching an enabled region bypasses the cache
+	reg unsigned [31:0] UncachedBase [0:3];
+	reg unsigned [31:0] UncachedMask [0:3];
+	reg Uncached_H;
+	integer Region;
+
+	// the word an uncached read wanted, kept once it has arrived while the rest of the burst goes by
+	reg unsigned [15:0] UncachedData;
+	reg UncachedDataValid_H;
+	reg UncachedDataReset_H;
+	reg UncachedDataLoad_H;
+	reg UncachedCycleOver_H;								// the 68k has ended the uncached read's bus cycle
+
+	// victim buffer, entry n's words are VictimData[n * LineWords + word]
+	reg unsigned [31:LineLow] VictimLine [0:7];
+	reg unsigned [15:0] VictimData [0:8*LineWords-1];
+	reg unsigned [7:0] VictimValid;
+	reg unsigned [2:0] VictimNext;						// entry to use for the next captured line
+	reg unsigned [2:0] VictimCaptureEntry;				// entry the line being replaced is going into
+	reg VictimCapturing_H;									// replacement block's old line is being copied into VictimCaptureEntry
+	reg VictimCaptureKeep_H;								// and it was a valid line worth keeping
+	reg VictimCaptureStart_H;								// the replacement block's tag is about to be overwritten
+	reg VictimCaptureWord_H;								// copy the replacement block's word at VictimWordAddress
+	reg unsigned [WordBits-1:0] VictimWordAddress;
+	reg VictimCaptureEnd_H;
+	reg VictimHit_H;											// FillAddress is in the victim buffer
+	reg unsigned [2:0] VictimHitEntry;
+	reg VictimHitNow_H;										// 68k address is in the victim buffer
+	wire VictimKeep_H;
+	integer Victim;
+	integer VictimLookup;
+	reg unsigned [15:0] FillBufferData;					// word to put in the fill buffer, from Dram or the victim buffer
+
+	// copy of the words received so far during a burst fill so the 68k can be given them before the fill ends
+	reg unsigned [15:0] FillBuffer [0:LineWords-1];
+	reg unsigned [LineWords-1:0] FillBufferValid;
+	reg FillBufferReset_H;
+	reg FillBufferLoad_H;
+	wire unsigned [WordBits-1:0] FillWordAddress;				// word of the line arriving from Dram on this burst clock
+	wire FillLineHit_H;										// 68k is reading the line being filled
+	wire FillWordReady_H;									// and the word it wants is in the fill buffer or arriving now
+
+	// counter for the words written back to Dram when a dirty line is evicted
+	reg unsigned [WordBits-1:0] WriteBackCounter;
+	reg WriteBackCounterReset_L;
+	reg WriteBackCounterIncrement_H;
 	
 	
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Tree pseudo LRU bits after an access to 'Block':
+// walk from the root (bit 0) down to Block, setting each bit on the path to point away from it.
+// Node n's children are bits 2n+1 (lower numbered ways) and 2n+2 (upper), a 0 points at the lower side
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	function [Ways-2:0] PLRUAccess;
+		input [Ways-2:0] Bits;
+		input [WayBits-1:0] Block;
+		integer Level, Node;
+		begin
+			PLRUAccess = Bits;
+			Node = 0;
+			for(Level = WayBits - 1; Level >= 0; Level = Level - 1) begin
+				PLRUAccess[Node] = ~Block[Level];
+				Node = 2 * Node + 1 + Block[Level];
+			end
+		end
+	endfunction
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Tree pseudo LRU victim: follow the bits from the root, each one says which side was used least recently.
+// If that side has no block in Allowed take the other side instead
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	function [WayBits-1:0] PLRUVictim;
+		input [Ways-2:0] Bits;
+		input [Ways-1:0] Allowed;
+		integer Level, Node, Side, First;
+		begin
+			Node = 0;
+			First = 0;													// lowest block number under Node
+			for(Level = WayBits - 1; Level >= 0; Level = Level - 1) begin
+				Side = Bits[Node];
+				if(((Allowed >> (First + Side * (1 << Level))) & ((1 << (1 << Level)) - 1)) == 0)
+					Side = 1 - Side;
+				PLRUVictim[Level] = Side;
+				First = First + Side * (1 << Level);
+				Node = 2 * Node + 1 + Side;
+			end
+		end
+	endfunction
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// True LRU ages after an access to 'Block': every block at least as recent as Block gets one older
+// (stopping at Ways-1) and Block becomes the most recent (0)
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	function [StateBits-1:0] LRUAccess;
+		input [StateBits-1:0] Ages;
+		input [WayBits-1:0] Block;
+		integer Way;
+		begin
+			LRUAccess = Ages;
+			for(Way = 0; Way < Ways; Way = Way + 1)
+				if(Way != Block && Ages[Way*FieldBits +: FieldBits] <= Ages[Block*FieldBits +: FieldBits] && Ages[Way*FieldBits +: FieldBits] != Ways - 1)
+					LRUAccess[Way*FieldBits +: FieldBits] = Ages[Way*FieldBits +: FieldBits] + 1;
+			LRUAccess[Block*FieldBits +: FieldBits] = 0;
+		end
+	endfunction
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Replacement state after a hit on 'Block'
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	function [StateBits-1:0] ReplacementHit;
+		input [StateBits-1:0] State;
+		input [WayBits-1:0] Block;
+		begin
+			ReplacementHit = State;
+			if(ReplacementPolicy == PLRUPolicy)
+				ReplacementHit = PLRUAccess(State, Block);
+			else if(ReplacementPolicy == LRUPolicy)
+				ReplacementHit = LRUAccess(State, Block);
+			else if(ReplacementPolicy == SRRIPPolicy)
+				ReplacementHit[Block*FieldBits +: FieldBits] = 0;				// re-referenced, expect it again soon
+		end
+	endfunction
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Block to replace, one of those in Allowed. LRU and SRRIP take the block with the largest age/prediction
+// (lowest numbered on a tie), random takes the first allowed block at or after a random one
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	function [WayBits-1:0] ReplacementVictim;
+		input [StateBits-1:0] State;
+		input [Ways-1:0] Allowed;
+		input [15:0] Random;
+		integer Way, Oldest, Found;
+		begin
+			ReplacementVictim = 0;
+			if(ReplacementPolicy == PLRUPolicy)
+				ReplacementVictim = PLRUVictim(State, Allowed);
+			else if(ReplacementPolicy == RandomPolicy) begin
+				Found = 0;
+				for(Way = 0; Way < Ways; Way = Way + 1)
+					if(Found == 0 && Allowed[(Random[WayBits-1:0] + Way) & (Ways - 1)] == 1) begin
+						ReplacementVictim = (Random[WayBits-1:0] + Way) & (Ways - 1);
+						Found = 1;
+					end
+			end
+			else begin
+				Oldest = 0;
+				Found = 0;
+				for(Way = 0; Way < Ways; Way = Way + 1)
+					if(Allowed[Way] == 1 && (Found == 0 || State[Way*FieldBits +: FieldBits] > Oldest)) begin
+						Oldest = State[Way*FieldBits +: FieldBits];
+						ReplacementVictim = Way;
+						Found = 1;
+					end
+			end
+		end
+	endfunction
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Replacement state after 'Block' (chosen by ReplacementVictim) is filled. SRRIP first ages the allowed
+// blocks until the oldest is at 3, as if it had gone round incrementing them, then puts the new line in at 2
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	function [StateBits-1:0] ReplacementFill;
+		input [StateBits-1:0] State;
+		input [WayBits-1:0] Block;
+		input [Ways-1:0] Allowed;
+		integer Way, Oldest;
+		begin
+			ReplacementFill = State;
+			if(ReplacementPolicy == PLRUPolicy)
+				ReplacementFill = PLRUAccess(State, Block);
+			else if(ReplacementPolicy == LRUPolicy)
+				ReplacementFill = LRUAccess(State, Block);
+			else if(ReplacementPolicy == SRRIPPolicy) begin
+				Oldest = State[Block*FieldBits +: FieldBits];
+				for(Way = 0; Way < Ways; Way = Way + 1)
+					if(Allowed[Way] == 1)
+						ReplacementFill[Way*FieldBits +: FieldBits] = State[Way*FieldBits +: FieldBits] + (3 - Oldest);
+				ReplacementFill[Block*FieldBits +: FieldBits] = 2;
+			end
+		end
+	endfunction
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// block number of a one hot hit
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	function [WayBits-1:0] HitBlockNumber;
+		input [Ways-1:0] Hit;
+		integer Block;
+		begin
+			HitBlockNumber = 0;
+			for(Block = 0; Block < Ways; Block = Block + 1)
+				if(Hit[Block] == 1)
+					HitBlockNumber = HitBlockNumber | Block;
+		end
+	endfunction
+
 	// start
 	assign CacheState = CurrentState;								// for debugging purposes only
+	assign VictimCurrent_H = (TagDataInFromCache[EpochBits+TagBits-1:TagBits] == Epoch);
+	assign VictimDirty_H = ((DirtyBits[Index] & Valid_H & ReplaceBlockMask) != 0) & VictimCurrent_H;
+
+	assign CacheRegDtack_L = ~(CacheRegSelect_H & ~AS_L);				// registers are always ready
+	assign CacheRegWrite_H = CacheRegSelect_H & ~AS_L & ~WE_L & (~UDS_L | ~LDS_L);
+	assign CacheRegRead_H = CacheRegSelect_H & ~AS_L & WE_L;
+	assign CounterClear_H = CacheRegWrite_H & (AddressBusInFrom68k[7:1] == 7'h19);		// 0x32
+	assign PrefetchEnable_H = CacheControl[0];
+	assign ClassWays_H = (FC[2] == 1) ? SupervisorWays : (FC[1] == 1) ? CodeWays : DataWays;
+	assign ReplaceAllowed_H = ((ClassWays_H & ~LockedWays) != 0) ? (ClassWays_H & ~LockedWays) : ~LockedWays;
+	assign HitUpdate_H = (WriteHitUpdate == 1 && SnoopCycle_H == 0);
+	assign Bypass_H = Uncached_H | (SnoopCycle_H & (ValidHit_H == 0));
+
+	assign WriteBufferFull_H = WriteBufferValid[WriteBufferTail];
+	assign WriteBufferEmpty_H = ~WriteBufferValid[WriteBufferHead];
+
+	assign PrefetchStart_H = (PrefetchState == PrefetchIdle && PrefetchPending_H == 1 && DramBusyForMain_H == 0 && DrainState == DrainIdle && WriteBufferEmpty_H == 1 &&
+									  RefreshSoon_H == 0);
+	assign StreamBufferDiscard_H = StreamBufferValid_H & (PrefetchStart_H | StreamBufferFlush_H | (StreamBufferInvalidate_H & (StreamBufferInvalidateLine == StreamBufferLine)));
+	assign PrefetchLineWritten_H = (PrefetchState != PrefetchIdle && (StreamBufferFlush_H == 1 || (StreamBufferInvalidate_H == 1 && StreamBufferInvalidateLine == PrefetchLine)));
+
+	assign FillWordAddress = BurstCounter[WordBits-1:0] + ((CriticalWordFirst == 1) ? FillAddress[WordBits:1] : 0);		// the burst starts at word 0 without CriticalWordFirst
+	assign FillLineHit_H = (AS_L == 0 && DramSelect68k_H == 1 && WE_L == 1 && AddressBusInFrom68k[31:LineLow] == FillAddress[31:LineLow]);
+	assign FillWordReady_H = FillBufferValid[AddressBusInFrom68k[WordBits:1]] | ((StateOneHot[BurstFill] == 1 || StateOneHot[CopyVictimIntoCache] == 1) && BurstCounter < LineWords && FillWordAddress == AddressBusInFrom68k[WordBits:1]);
+	assign VictimKeep_H = ((Valid_H & ReplaceBlockMask) != 0) & VictimCurrent_H;
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // concurrent process state registers
@@ -104,13 +558,22 @@ module M68kAssociativeCacheController_Verilog (
    always@(posedge Clock, negedge Reset_L)
 	begin
 		if(Reset_L == 0)
-			CurrentState <= Reset ;
+			StateOneHot <= 21'd1 << Reset;
 		else
-			CurrentState <= NextState;	
+			StateOneHot <= NextState;
+	end
+
+	// encoded state, for debugging only
+	always@(*)
+	begin
+		CurrentState = 0;												// blocking, so the loop works in order like software
+		for(StateNumber = 0; StateNumber < 21; StateNumber = StateNumber + 1)
+			if(StateOneHot[StateNumber] == 1)
+				CurrentState = StateNumber;
 	end
 	
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Burst read counter: Used to provide a 3 bit address to the Data in the Cache during burst reads from Dram
+// Burst read counter: Used to provide a word address to the Data in the Cache during burst reads from Dram
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 	always@(posedge Clock)
@@ -127,21 +590,648 @@ module M68kAssociativeCacheController_Verilog (
 
 	always@(posedge Clock)
 	begin
-		if(LoadReplacementBlockNumber_H == 1) 
+		if(LoadReplacementBlockNumber_H == 1) begin
 			ReplaceBlockNumber <= ReplaceBlockNumberData;			// store the chosen block number
+			ReplaceBlockMask <= 1 << ReplaceBlockNumberData;		// and decode it once for the write enables
+		end
 	end
 	
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// register to store the LRU block bits:
+// register to store the LRU block bits, and the block a miss would replace: picking it here, in Idle, takes the
+// victim search off CheckForCacheHit's path to LRUBits_Out
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////	
 
 	always@(posedge Clock)
 	begin
-		if(LRUBits_Load_H == 1)
+		if(LRUBits_Load_H == 1) begin
 			LRUBits	<= LRUBits_In;			// store the chosen block number
+			ReplacementChoice <= ReplacementVictim(LRUBits_In, ReplaceAllowed_H, RandomBits);
+		end
+	end
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// LFSR for random replacement (x^16 + x^14 + x^13 + x^11 + 1), steps every clock
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+	always@(posedge Clock, negedge Reset_L)
+	begin
+		if(Reset_L == 0)
+			RandomBits <= 16'hACE1;
+		else
+			RandomBits <= {RandomBits[14:0], RandomBits[15] ^ RandomBits[13] ^ RandomBits[12] ^ RandomBits[10]};
+	end
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// dirty bits: only ever set in write back mode, so they stay clear (and get optimised away) in write through mode
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+	always@(posedge Clock)
+	begin
+		if(DirtyBit_WE_H == 1 && WriteBackMode == 1) begin
+			if(DirtyBitOut_H == 1)
+				DirtyBits[Index] <= DirtyBits[Index] | DirtyBitBlockMask;
+			else
+				DirtyBits[Index] <= DirtyBits[Index] & ~DirtyBitBlockMask;
+		end
+	end
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// remember where a fast hit happened so its LRU bits can be updated on the next clock
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+	always@(posedge Clock)
+	begin
+		if(LoadLRUUpdate_H == 1) begin
+			LRUUpdateIndex <= AddressBusInFrom68k[TagLow-1:LineLow];
+			LRUUpdateBlockNumber <= HitBlockNumber(ValidHit_H);
+		end
+	end
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// latch the address of the missing line
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+	always@(posedge Clock)
+	begin
+		if(LoadFillAddress_H == 1)
+			FillAddress <= FillAddressData;
+	end
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Epoch: no reset, a reset of the 68k system moves it on to invalidate the cache (see top)
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+	always@(posedge Clock)
+	begin
+		if(EpochIncrement_H == 1 && Reset_L == 1)			// once per reset, not on every clock it is held
+			Epoch <= Epoch + 1;
+	end
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Fill buffer: records each word of the burst as it is written into the cache
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+	always@(posedge Clock)
+	begin
+		if(FillBufferReset_H == 1)
+			FillBufferValid <= 0;
+		else if(FillBufferLoad_H == 1) begin
+			FillBuffer[FillWordAddress] <= FillBufferData;
+			FillBufferValid[FillWordAddress] <= 1;
+		end
+	end
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Posted write buffer: entries go in at the tail from Idle and come out of the head when the drain 
+// state machine below has written them to Dram
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+	always@(posedge Clock, negedge Reset_L)
+	begin
+		if(Reset_L == 0) begin
+			WriteBufferValid <= 8'b00000000;
+			WriteBufferHead <= 3'b000;
+			WriteBufferTail <= 3'b000;
+		end
+		else begin
+			if(WriteBufferPush_H == 1) begin
+				WriteBufferAddress[WriteBufferTail] <= AddressBusInFrom68k;
+				WriteBufferData[WriteBufferTail] <= DataBusInFrom68k;
+				WriteBufferUDS_L[WriteBufferTail] <= UDS_L;
+				WriteBufferLDS_L[WriteBufferTail] <= LDS_L;
+				WriteBufferValid[WriteBufferTail] <= 1;
+				if(WriteBufferTail == WriteBufferDepth - 1)
+					WriteBufferTail <= 3'b000;
+				else
+					WriteBufferTail <= WriteBufferTail + 1;
+			end
+			
+			if(WriteBufferPop_H == 1) begin
+				WriteBufferValid[WriteBufferHead] <= 0;
+				if(WriteBufferHead == WriteBufferDepth - 1)
+					WriteBufferHead <= 3'b000;
+				else
+					WriteBufferHead <= WriteBufferHead + 1;
+			end
+		end
+	end
+
+	// is there a buffered write to the line we want to fill
+	always@(*)
+	begin
+		LineInWriteBuffer_H = 0;
+		for(i = 0; i < 8; i = i + 1)
+			if(WriteBufferValid[i] == 1 && WriteBufferAddress[i][31:LineLow] == FillAddress[31:LineLow])
+				LineInWriteBuffer_H = 1;
+	end
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Write buffer drain state machine: starts a Dram write for the head entry whenever the main state machine
+// is not using the Dram controller, waits for dtack, then ends the cycle and frees the entry.
+// Its Dram controller signals are driven at the end of the next state and output logic below
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+	always@(posedge Clock, negedge Reset_L)
+	begin
+		if(Reset_L == 0)
+			DrainState <= DrainIdle;
+		else if(DrainState == DrainIdle) begin
+			if(WriteBufferEmpty_H == 0 && DramBusyForMain_H == 0 && PrefetchState == PrefetchIdle && DrainAllowed_H == 1)
+				DrainState <= DrainWrite;
+		end
+		else if(DrainState == DrainWrite) begin
+			if(DtackFromDram_L == 0)
+				DrainState <= DrainEndWrite;
+		end
+		else if(DtackFromDram_L == 1)								// DrainEndWrite: wait for the Dram controller to see the end of the cycle
+			DrainState <= DrainIdle;
+	end
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Next line prefetch state machine: same Dram read sequence as a burst fill but into the stream buffer.
+// It only starts when the write buffer is empty so it can never read a line with a write still pending,
+// and a write to the line while it is in flight cancels it. Its Dram controller signals are driven at the
+// end of the next state and output logic below
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+	always@(posedge Clock, negedge Reset_L)
+	begin
+		if(Reset_L == 0) begin
+			PrefetchState <= PrefetchIdle;
+			PrefetchPending_H <= 0;
+			PrefetchCancel_H <= 0;
+			StreamBufferValid_H <= 0;
+			PrefetchHits <= 0;
+			PrefetchUseless <= 0;
+		end
+		else begin
+			// new request, unless we already have (or are fetching) that line
+			if(PrefetchRequest_H == 1 && PrefetchEnable_H == 1 &&
+				!(StreamBufferValid_H == 1 && StreamBufferLine == PrefetchRequestLine) &&
+				!(PrefetchState != PrefetchIdle && PrefetchLine == PrefetchRequestLine)) begin
+				PrefetchPending_H <= 1;
+				PrefetchPendingLine <= PrefetchRequestLine;
+			end
+			else if(PrefetchStart_H == 1)
+				PrefetchPending_H <= 0;
+
+			if(PrefetchLineWritten_H == 1)
+				PrefetchCancel_H <= 1;
+
+			// stream buffer valid bit and the usefulness counters
+			if(StreamBufferConsume_H == 1) begin
+				StreamBufferValid_H <= 0;
+				PrefetchHits <= PrefetchHits + 1;
+			end
+			else if(StreamBufferDiscard_H == 1) begin
+				StreamBufferValid_H <= 0;
+				PrefetchUseless <= PrefetchUseless + 1;
+			end
+			else if(PrefetchState == PrefetchEnd) begin
+				if(PrefetchCancel_H == 1 || PrefetchLineWritten_H == 1)
+					PrefetchUseless <= PrefetchUseless + 1;
+				else begin
+					StreamBufferValid_H <= 1;
+					StreamBufferLine <= PrefetchLine;
+				end
+			end
+			if(CounterClear_H == 1) begin
+				PrefetchHits <= 0;
+				PrefetchUseless <= 0;
+			end
+
+			// the Dram read itself
+			if(PrefetchState == PrefetchIdle) begin
+				if(PrefetchStart_H == 1) begin
+					PrefetchLine <= PrefetchPendingLine;
+					PrefetchCancel_H <= 0;
+					PrefetchState <= PrefetchRead;
+				end
+			end
+			else if(PrefetchState == PrefetchRead) begin
+				if(CAS_Dram_L == 0 && RAS_Dram_L == 1)				// read, not a refresh
+					PrefetchState <= PrefetchCASDelay1;
+			end
+			else if(PrefetchState == PrefetchCASDelay1)
+				PrefetchState <= PrefetchCASDelay2;
+			else if(PrefetchState == PrefetchCASDelay2) begin
+				PrefetchCounter <= 0;
+				PrefetchState <= PrefetchBurst;
+			end
+			else if(PrefetchState == PrefetchBurst) begin
+				StreamBuffer[PrefetchCounter] <= DataBusInFromDram;
+				PrefetchCounter <= PrefetchCounter + 1;
+				if(PrefetchCounter == LineWords - 1)
+					PrefetchState <= PrefetchEnd;
+			end
+			else
+				PrefetchState <= PrefetchIdle;
+		end
+	end
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Refresh tracking (see top). A refresh is taken to be over once the Dram controller issues a command
+// or gives a dtack, or after RefreshBusyClocks
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+	always@(posedge Clock, negedge Reset_L)
+	begin
+		if(Reset_L == 0) begin
+			RefreshAge <= 16'hFFFF;
+			RefreshPeriod <= 0;
+			RefreshBusy_H <= 0;
+		end
+		else if(CAS_Dram_L == 0 && RAS_Dram_L == 0) begin
+			if(RefreshAge != 0 && RefreshAge != 16'hFFFF)		// first clock of a refresh that follows another
+				RefreshPeriod <= RefreshAge;
+			RefreshAge <= 0;
+			RefreshBusy_H <= 1;
+		end
+		else begin
+			if(RefreshAge != 16'hFFFF)
+				RefreshAge <= RefreshAge + 1;
+			if((CAS_Dram_L == 0 && RAS_Dram_L == 1) || DtackFromDram_L == 0 || RefreshAge >= RefreshBusyClocks)
+				RefreshBusy_H <= 0;
+		end
 	end
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	assign RefreshSoon_H = (RefreshGuardClocks > 0 && RefreshPeriod != 0 && RefreshAge != 16'hFFFF && RefreshAge + RefreshGuardClocks >= RefreshPeriod);
+	assign DrainAllowed_H = (RefreshSoon_H == 0 || WriteBufferFull_H == 1 || 
+									 ((StateOneHot[ReadDataFromDramIntoCache] == 1 || StateOneHot[UncachedRead] == 1) && LineInWriteBuffer_H == 1));
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Count strobes: the next state logic's counter events registered, so the counters' 32 bit adders start at a flip
+// flop rather than at the end of the tag compare. Counts land a clock late, which no 68k read can see
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+	always@(posedge Clock, negedge Reset_L)
+	begin
+		if(Reset_L == 0)
+			CountStrobes <= 0;
+		else
+			CountStrobes <= {(RefreshBusy_H == 1 && DramBusyForMain_H == 1 && DramSelectFromCache_L == 0),		// 10
+								  (AS_L == 0 && DramSelect68k_H == 1 && DtackTo68k_L == 1),								// 9
+								  WriteBufferFullStall_H, CountBurstFillCycle_H, CountVictimHit_H, CountUncachedRead_H,		// 8 - 5
+								  CountWriteUpdate_H, CountWriteInvalidate_H, CountWrite_H, CountReadMiss_H, CountReadHit_H};	// 4 - 0
+	end
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Performance counters
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+	always@(posedge Clock, negedge Reset_L)
+	begin
+		if(Reset_L == 0) begin
+			ReadHits <= 0;
+			ReadMisses <= 0;
+			Writes <= 0;
+			WriteInvalidations <= 0;
+			WriteUpdates <= 0;
+			UncachedReads <= 0;
+			VictimHits <= 0;
+			BurstFillCycles <= 0;
+			StallCycles <= 0;
+			RefreshCollisions <= 0;
+			WriteBufferFullStalls <= 0;
+			RefreshStallCycles <= 0;
+			RefreshSeen_H <= 0;
+		end
+		else if(CounterClear_H == 1) begin
+			ReadHits <= 0;
+			ReadMisses <= 0;
+			Writes <= 0;
+			WriteInvalidations <= 0;
+			WriteUpdates <= 0;
+			UncachedReads <= 0;
+			VictimHits <= 0;
+			BurstFillCycles <= 0;
+			StallCycles <= 0;
+			RefreshCollisions <= 0;
+			WriteBufferFullStalls <= 0;
+			RefreshStallCycles <= 0;
+		end
+		else begin
+			if(CountStrobes[0] == 1)
+				ReadHits <= ReadHits + 1;
+			if(CountStrobes[1] == 1)
+				ReadMisses <= ReadMisses + 1;
+			if(CountStrobes[2] == 1)
+				Writes <= Writes + 1;
+			if(CountStrobes[3] == 1)
+				WriteInvalidations <= WriteInvalidations + 1;
+			if(CountStrobes[4] == 1)
+				WriteUpdates <= WriteUpdates + 1;
+			if(CountStrobes[5] == 1)
+				UncachedReads <= UncachedReads + 1;
+			if(CountStrobes[6] == 1)
+				VictimHits <= VictimHits + 1;
+			if(CountStrobes[7] == 1)
+				BurstFillCycles <= BurstFillCycles + 1;
+			if(CountStrobes[8] == 1)
+				WriteBufferFullStalls <= WriteBufferFullStalls + 1;
+			
+			// any clock the 68k is waiting on a Dram access
+			if(CountStrobes[9] == 1)
+				StallCycles <= StallCycles + 1;
+			
+			// a refresh starting while we are trying to use the Dram
+			RefreshSeen_H <= (CAS_Dram_L == 0 && RAS_Dram_L == 0);
+			if(CAS_Dram_L == 0 && RAS_Dram_L == 0 && RefreshSeen_H == 0 && DramSelectFromCache_L == 0)
+				RefreshCollisions <= RefreshCollisions + 1;
+
+			// and every clock the main state machine is held up by one
+			if(CountStrobes[10] == 1)
+				RefreshStallCycles <= RefreshStallCycles + 1;
+		end
+	end
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Cache registers: writes happen on every clock of the 68k's write cycle (they are all idempotent),
+// reading the upper word of a counter freezes its lower word so a long word read is consistent
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+	always@(posedge Clock, negedge Reset_L)
+	begin
+		if(Reset_L == 0)
+			CacheControl <= 16'h0000;
+		else if(CacheRegWrite_H == 1 && AddressBusInFrom68k[7:1] == 7'h18) begin		// 0x30
+			if(UDS_L == 0)
+				CacheControl[15:8] <= DataBusInFrom68k[15:8];
+			if(LDS_L == 0)
+				CacheControl[7:0] <= DataBusInFrom68k[7:0];
+		end
+	end
+
+	// way masks, 0 is stored as all ones so there is always somewhere to put a line
+	always@(posedge Clock, negedge Reset_L)
+	begin
+		if(Reset_L == 0) begin
+			CodeWays <= (CodeWayMask[Ways-1:0] == 0) ? {Ways{1'b1}} : CodeWayMask[Ways-1:0];
+			DataWays <= (DataWayMask[Ways-1:0] == 0) ? {Ways{1'b1}} : DataWayMask[Ways-1:0];
+			SupervisorWays <= (SupervisorWayMask[Ways-1:0] == 0) ? {Ways{1'b1}} : SupervisorWayMask[Ways-1:0];
+		end
+		else if(CacheRegWrite_H == 1) begin
+			if(AddressBusInFrom68k[7:1] == 7'h1D)											// 0x3A
+				CodeWays <= (DataBusInFrom68k[Ways-1:0] == 0) ? {Ways{1'b1}} : DataBusInFrom68k[Ways-1:0];
+			else if(AddressBusInFrom68k[7:1] == 7'h1E)									// 0x3C
+				DataWays <= (DataBusInFrom68k[Ways-1:0] == 0) ? {Ways{1'b1}} : DataBusInFrom68k[Ways-1:0];
+			else if(AddressBusInFrom68k[7:1] == 7'h1F)									// 0x3E
+				SupervisorWays <= (DataBusInFrom68k[Ways-1:0] == 0) ? {Ways{1'b1}} : DataBusInFrom68k[Ways-1:0];
+		end
+	end
+
+	// locked ways: no reset, like Epoch, so locked lines survive a reset of the 68k system.
+	// Any ways can be locked but not all of them, all ones locks all but the top way, so there is always somewhere to put a line
+	always@(posedge Clock)
+	begin
+		if(CacheRegWrite_H == 1 && Reset_L == 1 && AddressBusInFrom68k[7:1] == 7'h24)		// 0x48
+			LockedWays <= (DataBusInFrom68k[Ways-1:0] == {Ways{1'b1}}) ? {1'b0, {Ways-1{1'b1}}} : DataBusInFrom68k[Ways-1:0];
+	end
+
+	// command registers can only be written while no command is running, the range ones are then
+	// stepped through the lines by the CacheCommandLine state. A command is only started on the first 
+	// clock of the 68k's write, so a quick one finishing mid cycle does not run again
+	always@(posedge Clock, negedge Reset_L)
+	begin
+		if(Reset_L == 0) begin
+			CacheCommand <= 2'b00;
+			CacheCommandAddress <= 0;
+			CacheCommandLines <= 0;
+			CacheCommandBusy_H <= 0;
+			CacheRegWriteSeen_H <= 0;
+		end
+		else begin
+			CacheRegWriteSeen_H <= CacheRegWrite_H;
+			if(CacheCommandBusy_H == 1) begin
+				if(CacheCommandNextLine_H == 1) begin
+					CacheCommandAddress[31:LineLow] <= CacheCommandAddress[31:LineLow] + 1;
+					CacheCommandLines <= CacheCommandLines - 1;
+				end
+				if(CacheCommandDone_H == 1)
+					CacheCommandBusy_H <= 0;
+			end
+			else if(CacheRegWrite_H == 1) begin
+				if(AddressBusInFrom68k[7:1] == 7'h20)											// 0x40
+					CacheCommandAddress[31:16] <= DataBusInFrom68k;
+				else if(AddressBusInFrom68k[7:1] == 7'h21)									// 0x42
+					CacheCommandAddress[15:0] <= DataBusInFrom68k;
+				else if(AddressBusInFrom68k[7:1] == 7'h22)									// 0x44
+					CacheCommandLines <= DataBusInFrom68k;
+				else if(AddressBusInFrom68k[7:1] == 7'h23 && CacheRegWriteSeen_H == 0 && DataBusInFrom68k[1:0] != 2'b00) begin		// 0x46
+					CacheCommand <= DataBusInFrom68k[1:0];
+					CacheCommandBusy_H <= 1;
+				end
+			end
+		end
+	end
+
+	always@(posedge Clock)
+	begin
+		if(CacheRegRead_H == 1 && AddressBusInFrom68k[1] == 0) begin
+			case(AddressBusInFrom68k[7:2])
+				6'h00:	CounterLowWord <= ReadHits[15:0];
+				6'h01:	CounterLowWord <= ReadMisses[15:0];
+				6'h02:	CounterLowWord <= Writes[15:0];
+				6'h03:	CounterLowWord <= WriteInvalidations[15:0];
+				6'h04:	CounterLowWord <= BurstFillCycles[15:0];
+				6'h05:	CounterLowWord <= StallCycles[15:0];
+				6'h06:	CounterLowWord <= RefreshCollisions[15:0];
+				6'h07:	CounterLowWord <= WriteBufferFullStalls[15:0];
+				6'h08:	CounterLowWord <= PrefetchHits[15:0];
+				6'h09:	CounterLowWord <= PrefetchUseless[15:0];
+				6'h0A:	CounterLowWord <= WriteUpdates[15:0];
+				6'h0B:	CounterLowWord <= UncachedReads[15:0];
+				6'h20:	CounterLowWord <= VictimHits[15:0];
+				6'h21:	CounterLowWord <= VictimCaptures[15:0];
+				6'h22:	CounterLowWord <= RefreshStallCycles[15:0];
+				default:	CounterLowWord <= 16'h0000;
+			endcase
+		end
+	end
+
+	always@(*)
+	begin
+		case(AddressBusInFrom68k[7:1])
+			7'h00:	CacheRegDataOut <= ReadHits[31:16];
+			7'h02:	CacheRegDataOut <= ReadMisses[31:16];
+			7'h04:	CacheRegDataOut <= Writes[31:16];
+			7'h06:	CacheRegDataOut <= WriteInvalidations[31:16];
+			7'h08:	CacheRegDataOut <= BurstFillCycles[31:16];
+			7'h0A:	CacheRegDataOut <= StallCycles[31:16];
+			7'h0C:	CacheRegDataOut <= RefreshCollisions[31:16];
+			7'h0E:	CacheRegDataOut <= WriteBufferFullStalls[31:16];
+			7'h10:	CacheRegDataOut <= PrefetchHits[31:16];
+			7'h12:	CacheRegDataOut <= PrefetchUseless[31:16];
+			7'h14:	CacheRegDataOut <= WriteUpdates[31:16];
+			7'h16:	CacheRegDataOut <= UncachedReads[31:16];
+			7'h40:	CacheRegDataOut <= VictimHits[31:16];
+			7'h42:	CacheRegDataOut <= VictimCaptures[31:16];
+			7'h44:	CacheRegDataOut <= RefreshStallCycles[31:16];
+			7'h18:	CacheRegDataOut <= CacheControl;
+			7'h1A:	CacheRegDataOut <= Ways;
+			7'h1B:	CacheRegDataOut <= Sets;
+			7'h1C:	CacheRegDataOut <= LineWords;
+			7'h1D:	CacheRegDataOut <= CodeWays;
+			7'h1E:	CacheRegDataOut <= DataWays;
+			7'h1F:	CacheRegDataOut <= SupervisorWays;
+			7'h20:	CacheRegDataOut <= CacheCommandAddress[31:16];
+			7'h21:	CacheRegDataOut <= CacheCommandAddress[15:0];
+			7'h22:	CacheRegDataOut <= CacheCommandLines;
+			7'h23:	CacheRegDataOut <= CacheCommandBusy_H;
+			7'h24:	CacheRegDataOut <= LockedWays;
+			default:	begin
+				if(AddressBusInFrom68k[7:5] == 3'b011) begin									// 0x60-0x7F uncached regions
+					case(AddressBusInFrom68k[2:1])
+						2'b00:	CacheRegDataOut <= UncachedBase[AddressBusInFrom68k[4:3]][31:16];
+						2'b01:	CacheRegDataOut <= UncachedBase[AddressBusInFrom68k[4:3]][15:0];
+						2'b10:	CacheRegDataOut <= UncachedMask[AddressBusInFrom68k[4:3]][31:16];
+						default:	CacheRegDataOut <= UncachedMask[AddressBusInFrom68k[4:3]][15:0];
+					endcase
+				end
+				else
+					CacheRegDataOut <= ((AddressBusInFrom68k[7:1] < 7'h18 || AddressBusInFrom68k[7:5] == 3'b100) && AddressBusInFrom68k[1] == 1) ? CounterLowWord : 16'h0000;
+			end
+		endcase
+	end
+
+	// uncached region registers, regions beyond UncachedRegions stay disabled
+	always@(posedge Clock, negedge Reset_L)
+	begin
+		if(Reset_L == 0) begin
+			UncachedBase[0] <= 0;							// all regions disabled
+			UncachedBase[1] <= 0;
+			UncachedBase[2] <= 0;
+			UncachedBase[3] <= 0;
+		end
+		else if(CacheRegWrite_H == 1 && AddressBusInFrom68k[7:5] == 3'b011 && AddressBusInFrom68k[4:3] < UncachedRegions) begin
+			case(AddressBusInFrom68k[2:1])
+				2'b00:	UncachedBase[AddressBusInFrom68k[4:3]][31:16] <= DataBusInFrom68k;
+				2'b01:	UncachedBase[AddressBusInFrom68k[4:3]][15:0] <= DataBusInFrom68k;
+				2'b10:	UncachedMask[AddressBusInFrom68k[4:3]][31:16] <= DataBusInFrom68k;
+				default:	UncachedMask[AddressBusInFrom68k[4:3]][15:0] <= DataBusInFrom68k;
+			endcase
+		end
+	end
+
+	// is the 68k's address in an uncached region
+	always@(*)
+	begin
+		Uncached_H = 0;
+		for(Region = 0; Region < UncachedRegions; Region = Region + 1)
+			if(UncachedBase[Region][0] == 1 && ((AddressBusInFrom68k ^ UncachedBase[Region]) & UncachedMask[Region] & 32'hFFFFFFFE) == 0)
+				Uncached_H = 1;
+	end
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Uncached read data: the wanted word is kept from the burst, and we note when the 68k ends its cycle 
+// so a later read of the same address is not given this one's data
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+	always@(posedge Clock)
+	begin
+		if(UncachedDataReset_H == 1) begin
+			UncachedDataValid_H <= 0;
+			UncachedCycleOver_H <= 0;
+		end
+		else begin
+			if(UncachedDataLoad_H == 1) begin
+				UncachedData <= DataBusInFromDram;
+				UncachedDataValid_H <= 1;
+			end
+			if(AS_L == 1)
+				UncachedCycleOver_H <= 1;
+		end
+	end
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Victim buffer: when a fill is about to overwrite a block, its tag goes into the next entry (or the entry
+// that hit, for a swap) and its words follow as the fill overwrites them. The entry becomes valid at the end
+// of the fill if the old line was a valid one. Writes and invalidates to a line throw away its copy
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+	always@(posedge Clock, negedge Reset_L)
+	begin
+		if(Reset_L == 0) begin
+			VictimValid <= 8'b00000000;
+			VictimNext <= 3'b000;
+			VictimCapturing_H <= 0;
+			VictimCaptures <= 0;
+		end
+		else begin
+			if(VictimCaptureStart_H == 1 && VictimCapturing_H == 0 && VictimEntries > 0) begin
+				VictimCapturing_H <= 1;
+				VictimCaptureKeep_H <= VictimKeep_H;
+				if(VictimHit_H == 1) begin										// swap, the old line takes the place of the one coming out
+					VictimCaptureEntry <= VictimHitEntry;
+					VictimValid[VictimHitEntry] <= 0;
+					VictimLine[VictimHitEntry] <= {TagDataInFromCache[TagBits-1:0], FillAddress[TagLow-1:LineLow]};
+				end
+				else if(VictimKeep_H == 1) begin
+					VictimCaptureEntry <= VictimNext;
+					VictimValid[VictimNext] <= 0;
+					VictimLine[VictimNext] <= {TagDataInFromCache[TagBits-1:0], FillAddress[TagLow-1:LineLow]};
+					if(VictimNext == VictimEntries - 1)
+						VictimNext <= 3'b000;
+					else
+						VictimNext <= VictimNext + 1;
+				end
+			end
+
+			if(VictimCaptureEnd_H == 1 && VictimCapturing_H == 1) begin
+				VictimCapturing_H <= 0;
+				if(VictimCaptureKeep_H == 1) begin
+					VictimValid[VictimCaptureEntry] <= 1;
+					VictimCaptures <= VictimCaptures + 1;
+				end
+			end
+
+			for(Victim = 0; Victim < VictimEntries; Victim = Victim + 1)
+				if(StreamBufferFlush_H == 1 || (StreamBufferInvalidate_H == 1 && VictimLine[Victim] == StreamBufferInvalidateLine)) begin
+					VictimValid[Victim] <= 0;
+					if(VictimCapturing_H == 1 && VictimCaptureEntry == Victim)
+						VictimCaptureKeep_H <= 0;
+				end
+
+			if(CounterClear_H == 1)
+				VictimCaptures <= 0;
+		end
+	end
+
+	always@(posedge Clock)
+	begin
+		if(VictimCaptureWord_H == 1 && VictimCapturing_H == 1 && VictimCaptureKeep_H == 1)
+			VictimData[VictimCaptureEntry * LineWords + VictimWordAddress] <= DataBusInFromCache;
+	end
+
+	// look up the line being filled and the 68k's line in the victim buffer
+	always@(*)
+	begin
+		VictimHit_H = 0;
+		VictimHitEntry = 0;
+		VictimHitNow_H = 0;
+		for(VictimLookup = 0; VictimLookup < VictimEntries; VictimLookup = VictimLookup + 1) begin
+			if(VictimValid[VictimLookup] == 1 && VictimLine[VictimLookup] == FillAddress[31:LineLow]) begin
+				VictimHit_H = 1;
+				VictimHitEntry = VictimLookup;
+			end
+			if(VictimValid[VictimLookup] == 1 && VictimLine[VictimLookup] == AddressBusInFrom68k[31:LineLow])
+				VictimHitNow_H = 1;
+		end
+	end
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Write back counter: provides the word address while a dirty line is copied back to Dram
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+	always@(posedge Clock)
+	begin
+		if(WriteBackCounterReset_L == 0)
+			WriteBackCounter <= 0;
+		else if(WriteBackCounterIncrement_H == 1)
+			WriteBackCounter <= WriteBackCounter + 1;
+	end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
 // next state and output logic
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////	
 	
@@ -151,15 +1241,17 @@ module M68kAssociativeCacheController_Verilog (
 	
 		DataBusOutTo68k 					<= DataBusInFromCache;
 		DataBusOutToDramController 	<= DataBusInFrom68k;
+		DataBusOutToCache					<= DataBusInFromDram;							// cache is normally filled from Dram
+		CacheWaySelect_H					<= ValidHit_H;										// and normally reads from the block that hit
 
 		// default is to give the Dram the 68k's signals directly (unless we want to change something)	
 		
-		AddressBusOutToDramController[31:4]	<= AddressBusInFrom68k[31:4];
-		AddressBusOutToDramController[3:1]	<= 3'b000;								// all reads to Dram have lower 3 address lines set to 0 for a Cache line regardless of 68k address
+		AddressBusOutToDramController[31:LineLow]	<= AddressBusInFrom68k[31:LineLow];
+		AddressBusOutToDramController[WordBits:1]	<= 0;								// all reads to Dram have the word address lines set to 0 for a Cache line regardless of 68k address
 		AddressBusOutToDramController[0] 	<= 0;										// to avoid inferring a latch for this bit
 		
-		TagDataOut							<= AddressBusInFrom68k[31:11];				// tag is 21 bits
-		Index									<= AddressBusInFrom68k[10:4];				// cache Line is 7 bits for 128 Lines 4 way cache
+		TagDataOut							<= {Epoch, AddressBusInFrom68k[31:TagLow]};	// tag is TagBits (21 for 128 lines of 8 words), plus the current epoch
+		Index									<= AddressBusInFrom68k[TagLow-1:LineLow];	// cache Line is IndexBits (7 for 128 Lines)
 		
 		UDS_DramController_L				<= UDS_L;
 		LDS_DramController_L	   		<= LDS_L;
@@ -167,57 +1259,106 @@ module M68kAssociativeCacheController_Verilog (
 		AS_DramController_L				<= AS_L;
 		
 		DtackTo68k_L						<= 1;												// don't supply until we are ready
-		TagCache_WE_L 						<= 8'b11111111;										// don't write Cache address to any block
-		DataCache_WE_L 					<= 8'b11111111;										// don't write Cache data to any block
-		ValidBit_WE_L						<= 8'b11111111;										// don't write valid data to any block
+		TagCache_WE_L 						<= {Ways{1'b1}};									// don't write Cache address to any block
+		DataCache_WE_L 					<= {Ways{1'b1}};									// don't write Cache data to any block
+		ValidBit_WE_L						<= {Ways{1'b1}};									// don't write valid data to any block
 		ValidBitOut_H						<= 0;												// line invalid
 		DramSelectFromCache_L 			<= 1;												// don't give the Dram controller a select signal since we might not always want to cycle the Dram if we have a hit during a read
-		WordAddress							<= 3'b000;										// default is byte 0 in 8 byte Cache line	
+		WordAddress							<= 0;												// default is word 0 in the Cache line	
 		
 		BurstCounterReset_L 				<= 1;												// default is that burst counter can run (and wrap around if needed), we'll control when to reset it		
 		
-		ReplaceBlockNumberData 			<= 3'b000;			
+		ReplaceBlockNumberData 			<= 0;			
 		LoadReplacementBlockNumber_H 	<= 0 ;											// don't latch by default
-		LRUBits_Out							<= 7'b0000000;
+		LRUBits_Out							<= 0;
 		LRU_WE_L								<= 1;												// dont write	
 		LRUBits_Load_H						<= 0;
+
+		DirtyBit_WE_H						<= 0;
+		DirtyBitOut_H						<= 0;
+		DirtyBitBlockMask					<= 0;
+		WriteBackCounterReset_L			<= 1;
+		WriteBackCounterIncrement_H	<= 0;
+		LoadFillAddress_H					<= 0;
+		FillAddressData					<= AddressBusInFrom68k;
+		EpochIncrement_H					<= 0;
+		CacheCommandNextLine_H			<= 0;
+		CacheCommandDone_H				<= 0;
+		StreamBufferFlush_H				<= 0;
+		LoadLRUUpdate_H					<= 0;
+		WriteBufferPush_H					<= 0;
+		WriteBufferPop_H					<= 0;
+		WriteBufferFullStall_H			<= 0;
+		DramBusyForMain_H					<= 0;
+		PrefetchRequest_H					<= 0;
+		PrefetchRequestLine				<= AddressBusInFrom68k[31:LineLow] + 1;			// next line after the 68k's
+		StreamBufferConsume_H			<= 0;
+		StreamBufferInvalidate_H		<= 0;
+		StreamBufferInvalidateLine		<= AddressBusInFrom68k[31:LineLow];
+		CountReadHit_H						<= 0;
+		CountReadMiss_H					<= 0;
+		CountWrite_H						<= 0;
+		CountWriteInvalidate_H			<= 0;
+		CountWriteUpdate_H				<= 0;
+		CountUncachedRead_H				<= 0;
+		UncachedDataReset_H				<= 0;
+		UncachedDataLoad_H				<= 0;
+		CountVictimHit_H					<= 0;
+		VictimCaptureStart_H				<= 0;
+		VictimCaptureWord_H				<= 0;
+		VictimWordAddress					<= FillWordAddress;
+		VictimCaptureEnd_H				<= 0;
+		FillBufferData						<= DataBusInFromDram;
+		CountBurstFillCycle_H			<= 0;
+		FillBufferReset_H					<= 0;
+		FillBufferLoad_H					<= 0;
 		
-		NextState 							<= Idle ;										// default is to go to this state
+		NextState 							<= 21'd1 << Idle ;										// default is to go to this state
 			
 //////////////////////////////////////////////////////////////////
 // Initial State following a reset
 //////////////////////////////////////////////////////////////////
 		
-		if(CurrentState == Reset) 	begin	  												// if we are in the Reset state				
+		if(StateOneHot[Reset] == 1) 	begin	  												// if we are in the Reset state				
 			BurstCounterReset_L 	<= 0;														// reset the burst counter (synchronously)
-			NextState				<= InvalidateCache;									// go invalidate the cache
+			EpochIncrement_H		<= (LockedWays == 0);									// anything cached before the reset is now from an old epoch
+			if(Epoch == {EpochBits{1'b1}} || LockedWays != 0)
+				NextState			<= 21'd1 << InvalidateCache;									// epoch wrapping round (old lines could match it again), or locked lines to keep: sweep the cache
+			else
+				NextState			<= 21'd1 << Idle;
 		end
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////
 // This state will invalidate the cache before entering idle state and go through each set clearing each block
+// (only needed when the epoch wraps round, see top)
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////	
 
-		else if(CurrentState == InvalidateCache) begin	  						
+		else if(StateOneHot[InvalidateCache] == 1) begin	  						
 			
 			// burst counter should now be 0 when we first enter this state, as it was reset in state above
-			if(BurstCounter == 128) 														// if we have done all cache lines
-				NextState 						<= Idle;
+			if(BurstCounter == Sets) 														// if we have done all cache lines
+				NextState 						<= 21'd1 << Idle;
 			
 			else begin
-				NextState						<= InvalidateCache;					// assume we stay here
-				Index	 							<= BurstCounter[6:0];				// 7 bit Line address for Index for 128 set/lines of cache
+				NextState						<= 21'd1 << InvalidateCache;					// assume we stay here
+				Index	 							<= BurstCounter[IndexBits-1:0];	// Line address for Index, one clock per set
 				
-				// clear the validity bits for each cache
+				// clear the validity bits for each cache, apart from locked ways
 				ValidBitOut_H 					<=	0;		
-				ValidBit_WE_L					<= 8'b00000000;
+				ValidBit_WE_L					<= LockedWays;
 				
 				// clear the address tags for each cache set
-				TagDataOut						<= 21'b000000000000000000000;	
-				TagCache_WE_L					<= 8'b00000000;							// clear all tag bits in each Line
+				TagDataOut						<= 0;	
+				TagCache_WE_L					<= LockedWays;				// clear all tag bits in each unlocked Line
 				
 				// clear the LRU bits for each cache Line
-				LRUBits_Out						<= 7'b0000000;
+				LRUBits_Out						<= 0;
 				LRU_WE_L							<= 0;
+				
+				// and the dirty bits (write back mode)
+				DirtyBitOut_H					<= 0;
+				DirtyBit_WE_H					<= 1;
+				DirtyBitBlockMask				<= ~LockedWays;
 			end
 		end
 
@@ -225,21 +1366,100 @@ module M68kAssociativeCacheController_Verilog (
 // Main IDLE state: 
 ///////////////////////////////////////////////
 
-		else if(CurrentState == Idle) begin									// if we are in the idle state				
-			if (AS_L == 0 && DramSelect68k_H == 1) begin
+		else if(StateOneHot[Idle] == 1) begin									// if we are in the idle state				
+			if (CacheCommandBusy_H == 1) begin						//software cache command, goes ahead of any 68k access made after it
+				if (CacheCommand == InvalidateAllCommand) begin
+					EpochIncrement_H <= (LockedWays == 0);				//locked lines have to keep matching, so sweep the rest instead (see top)
+					StreamBufferFlush_H <= 1;
+					CacheCommandDone_H <= 1;
+					if (Epoch == {EpochBits{1'b1}} || LockedWays != 0) begin
+						BurstCounterReset_L <= 0;
+						NextState <= 21'd1 << InvalidateCache;
+					end
+				end
+				else
+					NextState <= 21'd1 << CacheCommandLine;
+			end
+			else if (AS_L == 0 && DramSelect68k_H == 1) begin
 				LRUBits_Load_H <= 1;
+				StreamBufferInvalidate_H <= ~WE_L;						//any write to a prefetched line makes the stream buffer copy stale
 				if (WE_L == 1) begin //read
 					UDS_DramController_L <= 0;
 					LDS_DramController_L <= 0;
-					NextState <= CheckForCacheHit;
+					if (Bypass_H == 1) begin							//uncached region or a DMA miss: straight to Dram, no line allocated
+						LoadFillAddress_H <= 1;
+						UncachedDataReset_H <= 1;
+						CountUncachedRead_H <= 1;
+						NextState <= 21'd1 << UncachedRead;
+					end
+					else if (FastHitMode == 1 && ValidHit_H > 0) begin	//fast hit: give the 68k its data now, LRU bits are written next clock
+						WordAddress <= AddressBusInFrom68k[WordBits:1];
+						DtackTo68k_L <= 0;
+						LoadLRUUpdate_H <= 1;
+						PrefetchRequest_H <= (AddressBusInFrom68k[WordBits:1] == LineWords - 1);		//reading the end of the line, get the next one ready
+						CountReadHit_H <= 1;
+						NextState <= 21'd1 << FastHitUpdateLRU;
+					end
+					else
+						NextState <= 21'd1 << CheckForCacheHit;
+				end
+				else if (WriteBackMode == 1 && Bypass_H == 1) begin	//write back, uncached region or DMA miss: write to Dram, no allocate
+					if (PrefetchState == PrefetchIdle && DrainState == DrainIdle) begin
+						DramSelectFromCache_L <= 0;
+						DramBusyForMain_H <= 1;
+						CountWrite_H <= 1;
+						NextState <= 21'd1 << WriteDataToDram;
+					end
+					else
+						NextState <= 21'd1 << Idle;
+				end
+				else if (WriteBackMode == 1) begin	//write back: writes look up the cache just like reads
+					NextState <= 21'd1 << CheckForCacheHit;
 				end
 				else begin 				//write
 					ValidBitOut_H <= 0;
-					if (ValidHit_H > 0) begin	//if any bits are 1, write 0 to corresponding ValidBit_WE_L bit; 	
-						ValidBit_WE_L <= {~ValidHit_H[7], ~ValidHit_H[6], ~ValidHit_H[5], ~ValidHit_H[4], ~ValidHit_H[3], ~ValidHit_H[2], ~ValidHit_H[1], ~ValidHit_H[0]};
+					if (ValidHit_H > 0 && HitUpdate_H == 0) begin	//if any bits are 1, write 0 to corresponding ValidBit_WE_L bit; 	
+						ValidBit_WE_L <= ~ValidHit_H;
+					end
+					if (WriteBufferDepth == 0) begin			//no write buffer, 68k waits for the Dram (and any cache update is done in WriteDataToDram)
+						if (PrefetchState == PrefetchIdle) begin
+							DramSelectFromCache_L <= 0;
+							DramBusyForMain_H <= 1;
+							CountWrite_H <= 1;
+							CountWriteInvalidate_H <= (ValidHit_H > 0 && HitUpdate_H == 0);
+							CountWriteUpdate_H <= (ValidHit_H > 0 && HitUpdate_H == 1);
+							NextState <= 21'd1 << WriteDataToDram;
+						end
+						else
+							NextState <= 21'd1 << Idle;
+					end
+					else if (UDS_L == 1 && LDS_L == 1)		//68k drives its data strobes after AS on a write, wait for them before posting
+						NextState <= 21'd1 << Idle;
+					else if (ValidHit_H > 0 && HitUpdate_H == 1 && (DrainState != DrainIdle || PrefetchState != PrefetchIdle) && RefreshBusy_H == 0) begin	//cache byte strobes are shared with the Dram controller, so let it finish first
+						DramBusyForMain_H <= 1;						//and start nothing new meanwhile
+						NextState <= 21'd1 << Idle;
+					end
+					else if (WriteBufferFull_H == 0) begin	//post the write and let the 68k carry on
+						WriteBufferPush_H <= 1;
+						CountWrite_H <= 1;
+						CountWriteInvalidate_H <= (ValidHit_H > 0 && HitUpdate_H == 0);
+						if (ValidHit_H > 0 && HitUpdate_H == 1 && DrainState == DrainIdle && PrefetchState == PrefetchIdle) begin		//write hit: update the cached word through the 68k's byte strobes, block stays valid
+							DataBusOutToCache <= DataBusInFrom68k;
+							WordAddress <= AddressBusInFrom68k[WordBits:1];
+							DataCache_WE_L <= ~ValidHit_H;
+							CountWriteUpdate_H <= 1;
+						end
+						else if (ValidHit_H > 0 && HitUpdate_H == 1) begin	//strobes tied up by a Dram cycle stuck behind a refresh: drop the line rather than wait
+							ValidBit_WE_L <= ~ValidHit_H;
+							CountWriteInvalidate_H <= 1;
+						end
+						DtackTo68k_L <= 0;
+						NextState <= 21'd1 << WaitForEndOfCacheRead;
+					end
+					else begin										//buffer full, wait here for the drain to free an entry
+						WriteBufferFullStall_H <= 1;
+						NextState <= 21'd1 << Idle;
 					end
-					DramSelectFromCache_L <= 0;
-					NextState <= WriteDataToDram;
 				end
 			end
 		end
@@ -249,75 +1469,57 @@ module M68kAssociativeCacheController_Verilog (
 // update the Least Recently Used Bits (LRUBits)
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
-		else if(CurrentState == CheckForCacheHit) begin				// we are looking for a Cache hit			
+		else if(StateOneHot[CheckForCacheHit] == 1) begin				// we are looking for a Cache hit			
 			UDS_DramController_L <= 0;
 			LDS_DramController_L <= 0;
 			LRU_WE_L <= 0;
+			CountWrite_H <= ~WE_L;										//only write back writes come here
 			if (ValidHit_H > 0) begin   //valid hit, get from cache, and update LRU
-				WordAddress <= AddressBusInFrom68k[3:1];
-				DtackTo68k_L <= 0;
-				NextState <= WaitForEndOfCacheRead;
-				if (LRUBits[2:0] == 3'b000) begin  //block 0. xxxx000
-					LRUBits_Out <= {LRUBits[6:3], 3'b111};
-				end 
-				else if (LRUBits[2:0] == 3'b100)begin  //block 1, xxxx100
-					LRUBits_Out <= {LRUBits[6:3], 3'b011};
-				end
-				else if (LRUBits[1:0] == 2'b10 && LRUBits[3] == 0)begin //block 2, xxx0x10
-					LRUBits_Out <= {LRUBits[6:4], 1'b1, LRUBits[2], 2'b01};	
-				end
-				else if (LRUBits[1:0] == 2'b10 && LRUBits[3] == 1)begin //block 3, xxx1x10
-					LRUBits_Out <= {LRUBits[6:4], 1'b0, LRUBits[2], 2'b01};	
-				end
-				else if (LRUBits[5:4] == 2'b00 && LRUBits[0] == 1)begin //block 4, x00xxx1
-					LRUBits_Out <= {LRUBits[6], 2'b11, LRUBits[3:1], 1'b0};	
+				CountReadHit_H <= WE_L;
+				WordAddress <= AddressBusInFrom68k[WordBits:1];
+				if (WE_L == 0) 			//write back write hit, update the cached word instead of Dram
+					NextState <= 21'd1 << WriteDataToCache;
+				else begin
+					DtackTo68k_L <= 0;
+					PrefetchRequest_H <= (AddressBusInFrom68k[WordBits:1] == LineWords - 1);		//reading the end of the line, get the next one ready
+					NextState <= 21'd1 << WaitForEndOfCacheRead;
 				end
-				else if (LRUBits[5:4] == 2'b10 && LRUBits[0] == 1)begin //block 5, x10xxx1
-					LRUBits_Out <= {LRUBits[6], 3'b01, LRUBits[3:1], 1'b0};	
-				end
-				else if (LRUBits[6] == 0 && LRUBits[4] == 1 && LRUBits[0] == 1)begin //block 6, 0x1xxx1
-					LRUBits_Out <= {1'b1, LRUBits[5], 1'b0, LRUBits[3:1], 1'b0};	
-				end
-				else begin																//block 7, 1x1xxx1
-					LRUBits_Out <= {1'b0, LRUBits[5], 1'b0, LRUBits[3:1], 1'b0};	
-				end				
+				LRUBits_Out <= ReplacementHit(LRUBits, HitBlockNumber(ValidHit_H));	//make the block that hit the most recently used
 			end
 			else begin 			//no hit, get from dram, and update LRU 
-				DramSelectFromCache_L <= 0;
-				if (LRUBits[2:0] == 3'b000) begin  //block 0. xxxx000
-					LRUBits_Out <= {LRUBits[6:3], 3'b111};
-					ReplaceBlockNumberData <= 3'b00;
-				end 
-				else if (LRUBits[2:0] == 3'b100)begin  //block 1, xxxx100
-					LRUBits_Out <= {LRUBits[6:3], 3'b011};
-					ReplaceBlockNumberData <= 3'b001;
-				end
-				else if (LRUBits[1:0] == 2'b10 && LRUBits[3] == 0)begin //block 2, xxx0x10
-					LRUBits_Out <= {LRUBits[6:4], 1'b1, LRUBits[2], 2'b01};	
-					ReplaceBlockNumberData <= 3'b010;
-				end
-				else if (LRUBits[1:0] == 2'b10 && LRUBits[3] == 1)begin //block 3, xxx1x10
-					LRUBits_Out <= {LRUBits[6:4], 1'b0, LRUBits[2], 2'b01};	
-					ReplaceBlockNumberData <= 3'b011;
-				end
-				else if (LRUBits[5:4] == 2'b00 && LRUBits[0] == 1)begin //block 4, x00xxx1
-					LRUBits_Out <= {LRUBits[6], 2'b11, LRUBits[3:1], 1'b0};	
-					ReplaceBlockNumberData <= 3'b100;
-				end
-				else if (LRUBits[5:4] == 2'b10 && LRUBits[0] == 1)begin //block 5, x10xxx1
-					LRUBits_Out <= {LRUBits[6], 3'b01, LRUBits[3:1], 1'b0};	
-					ReplaceBlockNumberData <= 3'b101;
-				end
-				else if (LRUBits[6] == 0 && LRUBits[4] == 1 && LRUBits[0] == 1)begin //block 6, 0x1xxx1
-					LRUBits_Out <= {1'b1, LRUBits[5], 1'b0, LRUBits[3:1], 1'b0};	
-					ReplaceBlockNumberData <= 3'b110;
+				CountReadMiss_H <= WE_L;
+				WE_DramController_L <= 1;		//write allocate fills the line with a read, even for a 68k write
+				if (CriticalWordFirst == 1)
+					AddressBusOutToDramController[WordBits:1] <= AddressBusInFrom68k[WordBits:1];
+				if (WriteBackMode == 0 && WriteBufferEmpty_H == 1 && DrainState == DrainIdle && PrefetchState == PrefetchIdle &&		//in write back mode we must first check the victim is clean before starting the Dram read
+					 !(StreamBufferValid_H == 1 && StreamBufferLine == AddressBusInFrom68k[31:LineLow]) && VictimHitNow_H == 0) begin	//and the stream or victim buffer may already have the line
+					DramSelectFromCache_L <= 0;
+					DramBusyForMain_H <= 1;
 				end
-				else begin																//block 7, 1x1xxx1
-					LRUBits_Out <= {1'b0, LRUBits[5], 1'b0, LRUBits[3:1], 1'b0};	
-					ReplaceBlockNumberData <= 3'b111;
-				end					
+				ReplaceBlockNumberData <= ReplacementChoice;												//replace the block the policy picks from those this kind of access may use
+				LRUBits_Out <= ReplacementFill(LRUBits, ReplacementChoice, ReplaceAllowed_H);	//and update the state for the new line
 				LoadReplacementBlockNumber_H <= 1;
-				NextState <= ReadDataFromDramIntoCache;
+				LoadFillAddress_H <= 1;
+				NextState <= 21'd1 << ReadDataFromDramIntoCache;
+			end
+		end
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+// Fast hit, 2nd clock: keep giving the 68k its data and write the LRU bits for the set that hit.
+// LRUBits were loaded from the LRU memory in Idle. If the 68k has already ended the cycle go
+// straight back to Idle, ready for the next one
+///////////////////////////////////////////////////////////////////////////////////////////////
+
+		else if(StateOneHot[FastHitUpdateLRU] == 1) begin
+			UDS_DramController_L <= 0;
+			LDS_DramController_L <= 0;
+			Index <= LRUUpdateIndex;
+			LRUBits_Out <= ReplacementHit(LRUBits, LRUUpdateBlockNumber);
+			LRU_WE_L <= 0;
+			WordAddress <= AddressBusInFrom68k[WordBits:1];
+			if (AS_L == 0) begin
+				DtackTo68k_L <= 0;
+				NextState <= 21'd1 << WaitForEndOfCacheRead;
 			end
 		end
 
@@ -325,13 +1527,13 @@ module M68kAssociativeCacheController_Verilog (
 // Got a Cache hit, so give the 68k the Cache data now then wait for the 68k to end bus cycle 
 ///////////////////////////////////////////////////////////////////////////////////////////////
 
-		else if(CurrentState == WaitForEndOfCacheRead) begin		
+		else if(StateOneHot[WaitForEndOfCacheRead] == 1) begin		
 			UDS_DramController_L <= 0;
 			LDS_DramController_L <= 0;
-			WordAddress <= AddressBusInFrom68k[3:1];
+			WordAddress <= AddressBusInFrom68k[WordBits:1];
 			DtackTo68k_L <= 0;
 			if (AS_L == 0) 
-				NextState <= WaitForEndOfCacheRead;
+				NextState <= 21'd1 << WaitForEndOfCacheRead;
 		end
 			
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -339,45 +1541,56 @@ module M68kAssociativeCacheController_Verilog (
 // Start of operation to Read from Dram State : Remember that CAS latency is 2 clocks before 1st item of burst data appears
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-		else if(CurrentState == ReadDataFromDramIntoCache) begin
+		else if(StateOneHot[ReadDataFromDramIntoCache] == 1) begin
+			CountBurstFillCycle_H <= 1;
 			UDS_DramController_L <= 0;
 			LDS_DramController_L <= 0;
-			DramSelectFromCache_L <= 0;
-			NextState <= ReadDataFromDramIntoCache;
-			if (CAS_Dram_L == 0 && RAS_Dram_L == 1) 
-				NextState <= CASDelay1;
-			ValidBitOut_H <= 1;
-			if (ReplaceBlockNumber == 3'b000) begin	//block 0
-				TagCache_WE_L <= 8'b11111110;				//write enabled for tag block 0
-				ValidBit_WE_L <= 8'b11111110;				//write enabled for valid block 0
-			end
-			else if (ReplaceBlockNumber == 3'b001) begin  //block 1
-				TagCache_WE_L <= 8'b11111101;
-				ValidBit_WE_L <= 8'b11111101;
+			WE_DramController_L <= 1;
+			Index <= FillAddress[TagLow-1:LineLow];
+			TagDataOut <= {Epoch, FillAddress[31:TagLow]};
+			CacheWaySelect_H <= ReplaceBlockMask;				//victim's epoch for VictimDirty_H
+			AddressBusOutToDramController[31:LineLow] <= FillAddress[31:LineLow];
+			if (CriticalWordFirst == 1)
+				AddressBusOutToDramController[WordBits:1] <= FillAddress[WordBits:1];
+			if (DrainState != DrainIdle || LineInWriteBuffer_H == 1 || PrefetchState != PrefetchIdle)		//write buffer is using the Dram or still holds a write to this line, let it drain first (or let a prefetch finish)
+				NextState <= 21'd1 << ReadDataFromDramIntoCache;
+			else if (WriteBackMode == 1 && VictimDirty_H == 1) begin		//victim holds modified data, copy it back to Dram before replacing it
+				WriteBackCounterReset_L <= 0;
+				WordAddress <= 0;
+				DramBusyForMain_H <= 1;
+				NextState <= 21'd1 << WriteBackDirtyWord;
 			end
-			else if (ReplaceBlockNumber == 3'b010) begin  //block 2
-				TagCache_WE_L <= 8'b11111011;
-				ValidBit_WE_L <= 8'b11111011;
-			end
-			else if (ReplaceBlockNumber == 3'b011) begin  //block 3
-				TagCache_WE_L <= 8'b11110111;
-				ValidBit_WE_L <= 8'b11110111;
-			end
-			else if (ReplaceBlockNumber == 3'b100) begin  //block 4
-				TagCache_WE_L <= 8'b11101111;
-				ValidBit_WE_L <= 8'b11101111;
-			end
-			else if (ReplaceBlockNumber == 3'b101) begin  //block 5
-				TagCache_WE_L <= 8'b11011111;
-				ValidBit_WE_L <= 8'b11011111;
-			end
-			else if (ReplaceBlockNumber == 3'b110) begin  //block 6
-				TagCache_WE_L <= 8'b10111111;
-				ValidBit_WE_L <= 8'b10111111;
-			end
-			else begin												//block 7
-				TagCache_WE_L <= 8'b01111111;
-				ValidBit_WE_L <= 8'b01111111;
+			else begin
+				DramBusyForMain_H <= 1;
+				PrefetchRequestLine <= FillAddress[31:LineLow] + 1;
+				VictimCaptureStart_H <= 1;														//replacement block's line goes into the victim buffer
+				if (StreamBufferValid_H == 1 && StreamBufferLine == FillAddress[31:LineLow]) begin		//prefetched, copy it in from the stream buffer
+					BurstCounterReset_L <= 0;
+					StreamBufferConsume_H <= 1;
+					PrefetchRequest_H <= 1;													//stream is being followed, fetch the line after
+					NextState <= 21'd1 << CopyStreamBufferIntoCache;
+				end
+				else if (VictimHit_H == 1) begin											//recently evicted, swap it back in from the victim buffer
+					BurstCounterReset_L <= 0;
+					FillBufferReset_H <= 1;
+					CountVictimHit_H <= 1;
+					NextState <= 21'd1 << CopyVictimIntoCache;
+				end
+				else begin
+					DramSelectFromCache_L <= 0;
+					AS_DramController_L <= 0;
+					NextState <= 21'd1 << ReadDataFromDramIntoCache;
+					if (CAS_Dram_L == 0 && RAS_Dram_L == 1) begin
+						PrefetchRequest_H <= 1;												//fetch the next line once this fill is done with the Dram
+						NextState <= 21'd1 << CASDelay1;
+					end
+				end
+				DirtyBitOut_H <= 0;								//new line starts out clean
+				DirtyBit_WE_H <= 1;
+				DirtyBitBlockMask <= ReplaceBlockMask;
+				ValidBitOut_H <= 1;
+				TagCache_WE_L <= ~ReplaceBlockMask;			//write enabled for the replacement block's tag
+				ValidBit_WE_L <= ~ReplaceBlockMask;			//and valid bit
 			end
 		end
 						
@@ -385,94 +1598,402 @@ module M68kAssociativeCacheController_Verilog (
 // Wait for 1st CAS clock (latency)
 ///////////////////////////////////////////////////////////////////////////////////////
 			
-		else if(CurrentState == CASDelay1) begin						
+		else if(StateOneHot[CASDelay1] == 1) begin						
+			CountBurstFillCycle_H <= 1;
+			DramBusyForMain_H <= 1;
 			UDS_DramController_L <= 0;
 			LDS_DramController_L <= 0;
 			DramSelectFromCache_L <= 0;
-			NextState <= CASDelay2;
+			AS_DramController_L <= 0;
+			WE_DramController_L <= 1;
+			Index <= FillAddress[TagLow-1:LineLow];
+			AddressBusOutToDramController[31:LineLow] <= FillAddress[31:LineLow];
+			if (CriticalWordFirst == 1)
+				AddressBusOutToDramController[WordBits:1] <= FillAddress[WordBits:1];
+			NextState <= 21'd1 << CASDelay2;
 		end
 		
 ///////////////////////////////////////////////////////////////////////////////////////
 // Wait for 2nd CAS Clock Latency
 ///////////////////////////////////////////////////////////////////////////////////////
 			
-		else if(CurrentState == CASDelay2) begin						
+		else if(StateOneHot[CASDelay2] == 1) begin						
+			CountBurstFillCycle_H <= 1;
+			DramBusyForMain_H <= 1;
 			UDS_DramController_L <= 0;
 			LDS_DramController_L <= 0;
 			DramSelectFromCache_L <= 0;
+			AS_DramController_L <= 0;
+			WE_DramController_L <= 1;
+			Index <= FillAddress[TagLow-1:LineLow];
+			AddressBusOutToDramController[31:LineLow] <= FillAddress[31:LineLow];
+			if (CriticalWordFirst == 1)
+				AddressBusOutToDramController[WordBits:1] <= FillAddress[WordBits:1];
 			BurstCounterReset_L <= 0;
-			NextState <= BurstFill;
+			FillBufferReset_H <= 1;
+			NextState <= 21'd1 << BurstFill;
 		end
 
 /////////////////////////////////////////////////////////////////////////////////////////////
 // Start of burst fill from Dram into Cache (data should be available at Dram in this  state)
+// The burst starts at FillAddress[WordBits:1] and wraps, everything here uses the latched FillAddress
+// because once the 68k has its word it can move on. Any read of the line being filled is given 
+// its dtack as soon as the word it wants has arrived, anything else waits for the fill to end
 /////////////////////////////////////////////////////////////////////////////////////////////
 		
-		else if(CurrentState == BurstFill) begin
+		else if(StateOneHot[BurstFill] == 1) begin
+			CountBurstFillCycle_H <= 1;
+			DramBusyForMain_H <= 1;
 			UDS_DramController_L <= 0;
 			LDS_DramController_L <= 0;
 			DramSelectFromCache_L <= 0;
-			NextState <= BurstFill;
-			if (BurstCounter == 8) begin
-				NextState <= EndBurstFill;
+			AS_DramController_L <= 0;
+			WE_DramController_L <= 1;
+			Index <= FillAddress[TagLow-1:LineLow];
+			AddressBusOutToDramController[31:LineLow] <= FillAddress[31:LineLow];
+			if (CriticalWordFirst == 1)
+				AddressBusOutToDramController[WordBits:1] <= FillAddress[WordBits:1];
+			NextState <= 21'd1 << BurstFill;
+
+			if (FillLineHit_H == 1 && FillWordReady_H == 1) begin		//early dtack, from the fill buffer or straight off the Dram bus
+				DtackTo68k_L <= 0;
+				if (FillBufferValid[AddressBusInFrom68k[WordBits:1]] == 1)
+					DataBusOutTo68k <= FillBuffer[AddressBusInFrom68k[WordBits:1]];
+				else
+					DataBusOutTo68k <= DataBusInFromDram;
+			end
+
+			if (BurstCounter == LineWords) begin
+				NextState <= 21'd1 << EndBurstFill;
 			end
 			else begin
-				WordAddress <= BurstCounter[2:0];
+				WordAddress <= FillWordAddress;
+				FillBufferLoad_H <= 1;
+				CacheWaySelect_H <= ReplaceBlockMask;				//old word goes to the victim buffer as it is overwritten
+				VictimCaptureWord_H <= 1;
 				
-				if (ReplaceBlockNumber == 3'b000) begin	//block 0
-					DataCache_WE_L <= 8'b11111110;				//write enabled for data block 0
-				end
-				else if (ReplaceBlockNumber == 3'b001) begin  //block 1
-					DataCache_WE_L <= 8'b11111101;
-				end
-				else if (ReplaceBlockNumber == 3'b010) begin  //block 2
-					DataCache_WE_L <= 8'b11111011;
-				end
-				else if (ReplaceBlockNumber == 3'b011) begin  //block 3
-					DataCache_WE_L <= 8'b11110111;
-				end
-				else if (ReplaceBlockNumber == 3'b100) begin  //block 4
-					DataCache_WE_L <= 8'b11101111;
-				end
-				else if (ReplaceBlockNumber == 3'b101) begin  //block 5
-					DataCache_WE_L <= 8'b11011111;
-				end
-				else if (ReplaceBlockNumber == 3'b110) begin  //block 6
-					DataCache_WE_L <= 8'b10111111;
-				end
-				else begin												//block 7
-					DataCache_WE_L <= 8'b01111111;
-				end
+				DataCache_WE_L <= ~ReplaceBlockMask;			//write enabled for the replacement block's data
 			end
 		end
 			
 ///////////////////////////////////////////////////////////////////////////////////////
-// End Burst fill and give the CPU the data from the cache
+// Stream buffer hit: copy the prefetched line into the replacement block, one word a
+// clock. The whole line is already here so any read of it gets its dtack straight away
+// (marked as using the Dram so the prefetcher cannot overwrite the stream buffer yet)
 ///////////////////////////////////////////////////////////////////////////////////////
-		else if(CurrentState == EndBurstFill) begin							// wait for Dram case signal to go low
+		else if(StateOneHot[CopyStreamBufferIntoCache] == 1) begin
+			CountBurstFillCycle_H <= 1;
+			DramBusyForMain_H <= 1;
+			UDS_DramController_L <= 0;
+			LDS_DramController_L <= 0;
+			Index <= FillAddress[TagLow-1:LineLow];
+			NextState <= 21'd1 << CopyStreamBufferIntoCache;
+
+			if (FillLineHit_H == 1) begin
+				DtackTo68k_L <= 0;
+				DataBusOutTo68k <= StreamBuffer[AddressBusInFrom68k[WordBits:1]];
+			end
+
+			if (BurstCounter == LineWords)
+				NextState <= 21'd1 << EndBurstFill;
+			else begin
+				WordAddress <= BurstCounter[WordBits-1:0];
+				DataBusOutToCache <= StreamBuffer[BurstCounter[WordBits-1:0]];
+				DataCache_WE_L <= ~ReplaceBlockMask;
+				CacheWaySelect_H <= ReplaceBlockMask;
+				VictimCaptureWord_H <= 1;
+				VictimWordAddress <= BurstCounter[WordBits-1:0];
+			end
+		end
+
+///////////////////////////////////////////////////////////////////////////////////////
+// Victim buffer hit: swap the line with the replacement block one word a clock, starting
+// at the 68k's word. Words go through the fill buffer too so any read of the line gets 
+// its dtack as soon as its word has been copied, as in BurstFill
+///////////////////////////////////////////////////////////////////////////////////////
+		else if(StateOneHot[CopyVictimIntoCache] == 1) begin
+			CountBurstFillCycle_H <= 1;
+			DramBusyForMain_H <= 1;										//keeps the write buffer and prefetcher off the shared byte strobes
+			UDS_DramController_L <= 0;
+			LDS_DramController_L <= 0;
+			Index <= FillAddress[TagLow-1:LineLow];
+			CacheWaySelect_H <= ReplaceBlockMask;
+			NextState <= 21'd1 << CopyVictimIntoCache;
+
+			if (FillLineHit_H == 1 && FillWordReady_H == 1) begin
+				DtackTo68k_L <= 0;
+				if (FillBufferValid[AddressBusInFrom68k[WordBits:1]] == 1)
+					DataBusOutTo68k <= FillBuffer[AddressBusInFrom68k[WordBits:1]];
+				else
+					DataBusOutTo68k <= VictimData[VictimCaptureEntry * LineWords + FillWordAddress];
+			end
+
+			if (BurstCounter == LineWords)
+				NextState <= 21'd1 << EndBurstFill;
+			else begin
+				WordAddress <= FillWordAddress;
+				DataBusOutToCache <= VictimData[VictimCaptureEntry * LineWords + FillWordAddress];
+				DataCache_WE_L <= ~ReplaceBlockMask;
+				FillBufferData <= VictimData[VictimCaptureEntry * LineWords + FillWordAddress];
+				FillBufferLoad_H <= 1;
+				VictimCaptureWord_H <= 1;
+			end
+		end
+
+///////////////////////////////////////////////////////////////////////////////////////
+// End Burst fill and give the CPU the data from the cache if it is still (or again) 
+// accessing the line just filled, otherwise go back to idle to deal with whatever it is doing
+///////////////////////////////////////////////////////////////////////////////////////
+		else if(StateOneHot[EndBurstFill] == 1) begin							// wait for Dram case signal to go low
+			DramBusyForMain_H <= 1;
+			VictimCaptureEnd_H <= 1;
 			UDS_DramController_L <= 0;
 			LDS_DramController_L <= 0;
 			DramSelectFromCache_L <= 1;
-			DtackTo68k_L <= 0;
-			WordAddress <= AddressBusInFrom68k[3:1];
+			AS_DramController_L <= 1;
+			WordAddress <= AddressBusInFrom68k[WordBits:1];
 			DataBusOutTo68k <= DataBusInFromCache;
-			if (AS_L == 1 || DramSelect68k_H == 0) 
-				NextState <= Idle;
-			else
-				NextState <= EndBurstFill;
+			if (AS_L == 1 || DramSelect68k_H == 0 || AddressBusInFrom68k[31:LineLow] != FillAddress[31:LineLow]) 
+				NextState <= 21'd1 << Idle;
+			else if (WE_L == 0) begin							//write allocate: line is now in the cache so go write the 68k data into it
+				if (WriteBackMode == 1)
+					NextState <= 21'd1 << WriteDataToCache;
+				else
+					NextState <= 21'd1 << Idle;							//write through: a write started during the fill goes the normal way
+			end
+			else begin
+				DtackTo68k_L <= 0;
+				NextState <= 21'd1 << EndBurstFill;
+			end
 		end
 		
 ///////////////////////////////////////////////
 // Write Data to Dram State (no Burst)
 ///////////////////////////////////////////////
-		else if(CurrentState == WriteDataToDram) begin	  					// if we are writing data to Dram
+		else if(StateOneHot[WriteDataToDram] == 1) begin	  					// if we are writing data to Dram
+			DramBusyForMain_H <= 1;
 			AddressBusOutToDramController <= AddressBusInFrom68k;
 			DramSelectFromCache_L <= 0;
 			DtackTo68k_L <= DtackFromDram_L;
+			if (ValidHit_H > 0 && HitUpdate_H == 1 && (UDS_L == 0 || LDS_L == 0)) begin		//write hit: update the cached word as well
+				DataBusOutToCache <= DataBusInFrom68k;
+				WordAddress <= AddressBusInFrom68k[WordBits:1];
+				DataCache_WE_L <= ~ValidHit_H;
+			end
 			if (AS_L == 1 || DramSelect68k_H == 0) 
-				NextState <= Idle;
+				NextState <= 21'd1 << Idle;
+			else
+				NextState <= 21'd1 << WriteDataToDram;
+		end
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+// Write back mode: write the 68k data into the block that hit (or was just allocated) using 
+// the 68k's byte strobes, mark it dirty and end the cycle without going near the Dram
+///////////////////////////////////////////////////////////////////////////////////////////////
+		else if(StateOneHot[WriteDataToCache] == 1) begin
+			DataBusOutToCache <= DataBusInFrom68k;
+			WordAddress <= AddressBusInFrom68k[WordBits:1];
+			NextState <= 21'd1 << WriteDataToCache;
+			if (DrainState == DrainIdle && PrefetchState == PrefetchIdle && (UDS_L == 0 || LDS_L == 0)) begin		//cache byte strobes are shared with the Dram controller, so not while the write buffer or prefetcher is using it
+				DataCache_WE_L <= ~ValidHit_H;
+				DirtyBitOut_H <= 1;
+				DirtyBit_WE_H <= 1;
+				DirtyBitBlockMask <= ValidHit_H;
+				DtackTo68k_L <= 0;
+				NextState <= 21'd1 << WaitForEndOfCacheRead;			//same as a read hit from here on, hold dtack until the 68k ends the cycle
+			end
+		end
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+// Write back mode: copy one word of the dirty victim line back to Dram
+// address is the victim's tag + this set + word counter, data comes from the victim block
+///////////////////////////////////////////////////////////////////////////////////////////////
+		else if(StateOneHot[WriteBackDirtyWord] == 1) begin
+			DramBusyForMain_H <= 1;
+			CacheWaySelect_H <= ReplaceBlockMask;
+			WordAddress <= WriteBackCounter;
+			Index <= FillAddress[TagLow-1:LineLow];
+			AddressBusOutToDramController <= {TagDataInFromCache[TagBits-1:0], FillAddress[TagLow-1:LineLow], WriteBackCounter, 1'b0};
+			StreamBufferInvalidate_H <= 1;
+			StreamBufferInvalidateLine <= {TagDataInFromCache[TagBits-1:0], FillAddress[TagLow-1:LineLow]};
+			DataBusOutToDramController <= DataBusInFromCache;
+			UDS_DramController_L <= 0;
+			LDS_DramController_L <= 0;
+			WE_DramController_L <= 0;
+			AS_DramController_L <= 0;
+			DramSelectFromCache_L <= 0;
+			if (DtackFromDram_L == 0)
+				NextState <= 21'd1 << EndWriteBackDirtyWord;
 			else
-				NextState <= WriteDataToDram;
-		end		
+				NextState <= 21'd1 << WriteBackDirtyWord;
+		end
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+// End the Dram write for this word (Dram controller sees AS go high) and move on to the next.
+// WordAddress is advanced here so the cache has a clock to present the next word's data.
+// After the last word the victim is clean so we can go and do the normal burst fill, or if this
+// was a flush command go back and invalidate the line
+///////////////////////////////////////////////////////////////////////////////////////////////
+		else if(StateOneHot[EndWriteBackDirtyWord] == 1) begin
+			DramBusyForMain_H <= 1;
+			Index <= FillAddress[TagLow-1:LineLow];
+			CacheWaySelect_H <= ReplaceBlockMask;
+			WordAddress <= WriteBackCounter + 1;
+			AS_DramController_L <= 1;
+			WE_DramController_L <= 1;
+			NextState <= 21'd1 << EndWriteBackDirtyWord;
+			if (DtackFromDram_L == 1) begin
+				WriteBackCounterIncrement_H <= 1;
+				if (WriteBackCounter == LineWords - 1) begin
+					DirtyBitOut_H <= 0;
+					DirtyBit_WE_H <= 1;
+					DirtyBitBlockMask <= ReplaceBlockMask;
+					if (CacheCommandBusy_H == 1)				//the 68k cannot write a command while it waits for a miss, so this is a flush
+						NextState <= 21'd1 << CacheCommandLine;
+					else
+						NextState <= 21'd1 << ReadDataFromDramIntoCache;
+				end
+				else
+					NextState <= 21'd1 << WriteBackDirtyWord;
+			end
+		end
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+// Invalidate or flush command, one line per clock: look the line up like a 68k access and clear
+// its valid bit if it is in the cache. A dirty line being flushed is first copied back to Dram
+// by the write back states, which then return here to invalidate it (now clean)
+///////////////////////////////////////////////////////////////////////////////////////////////
+		else if(StateOneHot[CacheCommandLine] == 1) begin
+			Index <= CacheCommandAddress[TagLow-1:LineLow];
+			TagDataOut <= {Epoch, CacheCommandAddress[31:TagLow]};
+			StreamBufferInvalidate_H <= 1;
+			StreamBufferInvalidateLine <= CacheCommandAddress[31:LineLow];
+			NextState <= 21'd1 << CacheCommandLine;
+			if (CacheCommandLines == 0) begin
+				CacheCommandDone_H <= 1;
+				NextState <= 21'd1 << Idle;
+			end
+			else if (ValidHit_H > 0 && WriteBackMode == 1 && CacheCommand == FlushLinesCommand && (DirtyBits[CacheCommandAddress[TagLow-1:LineLow]] & ValidHit_H) != 0) begin
+				if (DrainState == DrainIdle && PrefetchState == PrefetchIdle) begin		//hit block and word 0 are already selected for WriteBackDirtyWord
+					FillAddressData <= CacheCommandAddress;
+					LoadFillAddress_H <= 1;
+					ReplaceBlockNumberData <= HitBlockNumber(ValidHit_H);
+					LoadReplacementBlockNumber_H <= 1;
+					WriteBackCounterReset_L <= 0;
+					DramBusyForMain_H <= 1;
+					NextState <= 21'd1 << WriteBackDirtyWord;
+				end
+			end
+			else begin
+				ValidBitOut_H <= 0;
+				ValidBit_WE_L <= ~ValidHit_H;
+				DirtyBitOut_H <= 0;
+				DirtyBit_WE_H <= 1;
+				DirtyBitBlockMask <= ValidHit_H;
+				CacheCommandNextLine_H <= 1;
+			end
+		end
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+// Uncached read: once the write buffer has nothing for this line and nothing else is using the
+// Dram, start a read of the word (CriticalWordFirst puts it first in the burst). 
+///////////////////////////////////////////////////////////////////////////////////////////////
+		else if(StateOneHot[UncachedRead] == 1) begin
+			UDS_DramController_L <= 0;
+			LDS_DramController_L <= 0;
+			WE_DramController_L <= 1;
+			AddressBusOutToDramController[31:LineLow] <= FillAddress[31:LineLow];
+			if (CriticalWordFirst == 1)
+				AddressBusOutToDramController[WordBits:1] <= FillAddress[WordBits:1];
+			NextState <= 21'd1 << UncachedRead;
+			if (DrainState == DrainIdle && LineInWriteBuffer_H == 0 && PrefetchState == PrefetchIdle) begin
+				DramBusyForMain_H <= 1;
+				DramSelectFromCache_L <= 0;
+				AS_DramController_L <= 0;
+				if (CAS_Dram_L == 0 && RAS_Dram_L == 1) begin
+					BurstCounterReset_L <= 0;
+					NextState <= 21'd1 << UncachedBurst;
+				end
+			end
+		end
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+// Let the burst go by (2 clocks CAS latency, then LineWords words), keeping only the word the
+// 68k wants. Nothing is written to the cache. The 68k gets its dtack as soon as the word is here
+///////////////////////////////////////////////////////////////////////////////////////////////
+		else if(StateOneHot[UncachedBurst] == 1) begin
+			DramBusyForMain_H <= 1;
+			UDS_DramController_L <= 0;
+			LDS_DramController_L <= 0;
+			DramSelectFromCache_L <= 0;
+			AS_DramController_L <= 0;
+			WE_DramController_L <= 1;
+			AddressBusOutToDramController[31:LineLow] <= FillAddress[31:LineLow];
+			if (CriticalWordFirst == 1)
+				AddressBusOutToDramController[WordBits:1] <= FillAddress[WordBits:1];
+			NextState <= 21'd1 << UncachedBurst;
+
+			if (BurstCounter == ((CriticalWordFirst == 1) ? 0 : FillAddress[WordBits:1]) + 2) begin		//wanted word is on the Dram bus
+				UncachedDataLoad_H <= 1;
+				DataBusOutTo68k <= DataBusInFromDram;
+				DtackTo68k_L <= AS_L | UncachedCycleOver_H;
+			end
+			else if (UncachedDataValid_H == 1) begin
+				DataBusOutTo68k <= UncachedData;
+				DtackTo68k_L <= AS_L | UncachedCycleOver_H;
+			end
+
+			if (BurstCounter == LineWords + 2)
+				NextState <= 21'd1 << UncachedEnd;
+		end
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+// End the Dram read, and keep giving the 68k its word until it ends the cycle
+///////////////////////////////////////////////////////////////////////////////////////////////
+		else if(StateOneHot[UncachedEnd] == 1) begin
+			DramBusyForMain_H <= 1;
+			DramSelectFromCache_L <= 1;
+			AS_DramController_L <= 1;
+			DataBusOutTo68k <= UncachedData;
+			if (AS_L == 0 && UncachedCycleOver_H == 0) begin
+				DtackTo68k_L <= 0;
+				NextState <= 21'd1 << UncachedEnd;
+			end
+		end
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+// The write buffer drain or the prefetcher own the Dram controller signals while they are 
+// using it (only one of them or the main state machine ever uses it at a time)
+///////////////////////////////////////////////////////////////////////////////////////////////
+		if(PrefetchState != PrefetchIdle) begin
+			AddressBusOutToDramController <= {PrefetchLine, {LineLow{1'b0}}};
+			UDS_DramController_L <= 0;
+			LDS_DramController_L <= 0;
+			WE_DramController_L <= 1;
+			if(PrefetchState == PrefetchEnd) begin
+				DramSelectFromCache_L <= 1;
+				AS_DramController_L <= 1;
+			end
+			else begin
+				DramSelectFromCache_L <= 0;
+				AS_DramController_L <= 0;
+			end
+		end
+		else if(DrainState != DrainIdle) begin
+			AddressBusOutToDramController <= WriteBufferAddress[WriteBufferHead];
+			DataBusOutToDramController <= WriteBufferData[WriteBufferHead];
+			UDS_DramController_L <= WriteBufferUDS_L[WriteBufferHead];
+			LDS_DramController_L <= WriteBufferLDS_L[WriteBufferHead];
+			WE_DramController_L <= 0;
+			if(DrainState == DrainWrite) begin
+				DramSelectFromCache_L <= 0;
+				AS_DramController_L <= 0;
+			end
+			else begin
+				DramSelectFromCache_L <= 1;
+				AS_DramController_L <= 1;
+				WriteBufferPop_H <= DtackFromDram_L;		//entry is done once the Dram controller has seen the end of the cycle
+			end
+		end
 	end
 endmodule
@@ -0,0 +1,398 @@
+///////////////////////////////////////////////////////////////////////////////////////
+// Simple DMA controller
+//
+// designed to sit alongside the TG68 (68000 based) cpu as a second bus master, moving blocks between
+// peripheral registers (IIC, Canbus controller) and Dram, or Dram to Dram, so the 68k no longer copies
+// them one register read or write at a time
+//
+// When it has a transfer to do it stops the TG68 between bus cycles (CpuHold_H, wired to the TG68's clock
+// enable inverted, only goes high while the 68k's own AS is high) and then owns the bus (DmaBusOwner_H
+// switches the schematic's address, data, strobe and function code multiplexers over to the Dma* signals,
+// FC = 101 while we own it). It runs ordinary 68000 style read and write cycles, so the address decoder,
+// the peripherals and the cache controller see them just like the 68k's. DmaBusOwner_H also drives the
+// cache controller's SnoopCycle_H: a Dram write by the DMA invalidates any cached copy of the line, and a
+// Dram read that misses the cache goes straight to Dram without allocating a line, so neither side needs
+// a cache flush around a transfer (see the cache controller for write back mode)
+//
+// Each transfer is a read of the source followed by a write of the destination, as bytes (address bit 0
+// picks UDS or LDS, the byte is driven on both halves of the data bus) or words. The 68k gets the bus back
+// after at most BurstTransfers transfers and keeps it until it has started a bus cycle of its own (or
+// GapClocks have gone by), so interrupts and tasks still run during a long transfer. A paced transfer
+// waits for DmaRequest_H before each transfer and does one per bus ownership: DmaRequest_H must have gone
+// low by then if the peripheral has nothing more (e.g. a receive ready flag cleared by reading its data
+// register). A cycle that gets no dtack within TimeoutClocks ends the transfer with the bus error bit set
+//
+// Registers, selected by DmaRegSelect_H (68k address 0x0040A000 - 0x0040A00F), are 16 bits wide. Source,
+// Destination and Count can only be written while no transfer is running
+//		0x0040A000	Source (long word, read/write) advances as the transfer runs if Control bit 1 is set
+//		0x0040A004	Destination (long word, read/write) advances as the transfer runs if Control bit 2 is set
+//		0x0040A008	Count (read/write) transfers left, counts down to 0
+//		0x0040A00A	Control (read/write)
+//						bit 0 = run: write 1 to start, reads 1 until the transfer has finished. Writing 0 stops
+//								  it after the transfer in progress (Source/Destination/Count show where)
+//						bit 1 = increment Source, bit 2 = increment Destination (by 1 for bytes, 2 for words)
+//						bit 3 = byte transfers, 0 = words
+//						bit 4 = paced by DmaRequest_H
+//						bit 5 = interrupt (DmaIRQ_L) when Status is non zero
+//		0x0040A00C	Status (read, write 1s to clear, starting a transfer clears both)
+//						bit 0 = done (Count reached 0)
+//						bit 1 = bus error (no dtack within TimeoutClocks, the failed transfer is left in the registers)
+///////////////////////////////////////////////////////////////////////////////////////
+
+
+module M68kDmaController_Verilog #(
+		parameter BurstTransfers = 4,										// transfers per bus ownership, 1-255
+		parameter GapClocks = 8,											// most the DMA waits for the 68k to start a cycle before taking the bus again
+		parameter TimeoutClocks = 1023									// clocks to wait for a dtack before giving up, up to 65535
+	)
+	(
+		input Clock,															// used to drive the state machine - state changes occur on positive edge
+		input Reset_L,    													// active low reset
+
+		// registers, seen by the 68k
+		input DmaRegSelect_H,												// active high when 68000 is addressing the DMA registers (address decoder)
+		input unsigned [31:0] AddressBusInFrom68k,					// address bus from 68000
+		input unsigned [15:0] DataBusInFrom68k,  						// data bus in from 68000
+		input UDS_L,	   													// active low signal driven by 68000 when 68000 transferring data over data bit 15-8
+		input LDS_L,	   													// active low signal driven by 68000 when 68000 transferring data over data bit 7-0
+		input WE_L, 															// active low write signal, otherwise assumed to be read
+		input AS_L,																// the 68k's own address strobe (before the bus multiplexers)
+		output reg unsigned [15:0] DmaRegDataOut,						// register data back to 68000 (during read)
+		output DmaRegDtack_L,												// Dtack back to 68k for a register access
+		output DmaIRQ_L,														// interrupt request to the 68k, level
+
+		// bus master side
+		output reg CpuHold_H,												// stop the TG68 (its clock enable, inverted)
+		output reg DmaBusOwner_H,											// we own the bus: multiplexer select, and the cache controller's SnoopCycle_H
+		output reg unsigned [31:0] DmaAddress,							// address bus out while we own the bus
+		output reg unsigned [15:0] DmaDataOut,							// data bus out (during our write)
+		input unsigned [15:0] DmaDataIn,									// the bus's read data, as the 68k would see it
+		output reg DmaAS_L,
+		output reg DmaUDS_L,
+		output reg DmaLDS_L,
+		output reg DmaWE_L,
+		input DmaDtack_L,														// the bus's dtack, as the 68k would see it
+		input DmaRequest_H,													// peripheral wants a paced transfer
+
+		// debugging only
+		output unsigned [3:0] DmaState
+	);
+
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// States
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	parameter	Idle								= 4'b0000;
+	parameter	WaitForBus						= 4'b0001;
+	parameter	ReadCycle						= 4'b0010;
+	parameter	ReadEnd							= 4'b0011;
+	parameter	WriteCycle						= 4'b0100;
+	parameter	WriteEnd							= 4'b0101;
+	parameter	ReleaseBus						= 4'b0110;
+
+	// 4 bit variables to hold current and next state of the state machine
+	reg unsigned [3:0] CurrentState;					// holds the current state of the DMA controller
+	reg unsigned [3:0] NextState; 						// holds the next state of the DMA controller
+
+	// the descriptor
+	reg unsigned [31:0] Source;
+	reg unsigned [31:0] Destination;
+	reg unsigned [15:0] Count;
+	reg unsigned [5:0] Control;
+	reg unsigned [1:0] Status;
+
+	// data read from the source, waiting to be written to the destination (a byte is kept in bits 7-0)
+	reg unsigned [15:0] TransferData;
+	reg TransferDataLoad_H;
+
+	// signals from the state machine to the registers
+	reg TransferStep_H;										// a transfer is complete, advance Source/Destination/Count
+	reg TransferDone_H;										// Count has reached 0, clear Control bit 0 and set done
+	reg TransferError_H;										// no dtack, set the bus error bit and stop
+
+	// transfers done this bus ownership, and clocks waited for a dtack or the 68k
+	reg unsigned [7:0] BurstCount;
+	reg BurstCountReset_H;
+	reg unsigned [15:0] WaitCounter;
+	reg WaitCounterReset_H;
+	reg CpuCycleSeen_H;										// 68k has started a bus cycle since we gave the bus back
+
+	wire RegWrite_H;
+	reg RegWriteSeen_H;										// register write seen last clock, so a write only starts a transfer once
+	wire unsigned [1:0] StepSize;
+
+	// start
+	assign DmaState = CurrentState;								// for debugging purposes only
+	assign DmaRegDtack_L = ~(DmaRegSelect_H & ~AS_L);				// registers are always ready
+	assign RegWrite_H = DmaRegSelect_H & ~AS_L & ~WE_L & (~UDS_L | ~LDS_L);
+	assign DmaIRQ_L = ~(Control[5] & (Status != 0));
+	assign StepSize = (Control[3] == 1) ? 2'd1 : 2'd2;
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// concurrent process state registers
+// this process RECORDS the current state of the system.
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+   always@(posedge Clock, negedge Reset_L)
+	begin
+		if(Reset_L == 0)
+			CurrentState <= Idle ;
+		else
+			CurrentState <= NextState;
+	end
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Descriptor registers: the 68k writes them (on every clock of its write cycle, they are idempotent apart from
+// starting a transfer, which only happens on the first clock), the state machine steps them
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+	always@(posedge Clock, negedge Reset_L)
+	begin
+		if(Reset_L == 0) begin
+			Source <= 0;
+			Destination <= 0;
+			Count <= 0;
+			Control <= 6'b000000;
+			Status <= 2'b00;
+			RegWriteSeen_H <= 0;
+		end
+		else begin
+			RegWriteSeen_H <= RegWrite_H;
+			if(TransferStep_H == 1) begin
+				if(Control[1] == 1)
+					Source <= Source + StepSize;
+				if(Control[2] == 1)
+					Destination <= Destination + StepSize;
+				Count <= Count - 1;
+			end
+			if(TransferDone_H == 1) begin
+				Control[0] <= 0;
+				Status[0] <= 1;
+			end
+			if(TransferError_H == 1) begin
+				Control[0] <= 0;
+				Status[1] <= 1;
+			end
+
+			if(RegWrite_H == 1) begin
+				if(AddressBusInFrom68k[3:1] == 3'b101) begin											// 0x0A
+					if(Control[0] == 0 && DataBusInFrom68k[0] == 1 && RegWriteSeen_H == 0) begin
+						Control <= DataBusInFrom68k[5:0];
+						Status <= 2'b00;
+					end
+					else if(Control[0] == 1 && DataBusInFrom68k[0] == 0)
+						Control[0] <= 0;
+					else
+						Control[5:1] <= DataBusInFrom68k[5:1];
+				end
+				else if(AddressBusInFrom68k[3:1] == 3'b110)											// 0x0C
+					Status <= Status & ~DataBusInFrom68k[1:0];
+				else if(Control[0] == 0) begin
+					if(AddressBusInFrom68k[3:1] == 3'b000)												// 0x00
+						Source[31:16] <= DataBusInFrom68k;
+					else if(AddressBusInFrom68k[3:1] == 3'b001)										// 0x02
+						Source[15:0] <= DataBusInFrom68k;
+					else if(AddressBusInFrom68k[3:1] == 3'b010)										// 0x04
+						Destination[31:16] <= DataBusInFrom68k;
+					else if(AddressBusInFrom68k[3:1] == 3'b011)										// 0x06
+						Destination[15:0] <= DataBusInFrom68k;
+					else if(AddressBusInFrom68k[3:1] == 3'b100)										// 0x08
+						Count <= DataBusInFrom68k;
+				end
+			end
+		end
+	end
+
+	always@(*)
+	begin
+		case(AddressBusInFrom68k[3:1])
+			3'b000:	DmaRegDataOut <= Source[31:16];
+			3'b001:	DmaRegDataOut <= Source[15:0];
+			3'b010:	DmaRegDataOut <= Destination[31:16];
+			3'b011:	DmaRegDataOut <= Destination[15:0];
+			3'b100:	DmaRegDataOut <= Count;
+			3'b101:	DmaRegDataOut <= Control;
+			3'b110:	DmaRegDataOut <= Status;
+			default:	DmaRegDataOut <= 16'h0000;
+		endcase
+	end
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Transfer data: a byte comes from the half of the data bus its address picks
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+	always@(posedge Clock)
+	begin
+		if(TransferDataLoad_H == 1) begin
+			if(Control[3] == 0)
+				TransferData <= DmaDataIn;
+			else if(Source[0] == 1)
+				TransferData[7:0] <= DmaDataIn[7:0];
+			else
+				TransferData[7:0] <= DmaDataIn[15:8];
+		end
+	end
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Burst and wait counters, and whether the 68k has had a go since we gave the bus back
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+	always@(posedge Clock)
+	begin
+		if(BurstCountReset_H == 1)
+			BurstCount <= 0;
+		else if(TransferStep_H == 1)
+			BurstCount <= BurstCount + 1;
+
+		if(WaitCounterReset_H == 1) begin
+			WaitCounter <= 0;
+			CpuCycleSeen_H <= 0;
+		end
+		else begin
+			if(WaitCounter != 16'hFFFF)
+				WaitCounter <= WaitCounter + 1;
+			if(AS_L == 0)
+				CpuCycleSeen_H <= 1;
+		end
+	end
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// next state and output logic
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+	always@(*)
+	begin
+		// start with default inactive values for everything and override as necessary, so we do not infer storage for signals inside this process
+
+		CpuHold_H							<= 0;
+		DmaBusOwner_H						<= 0;
+		DmaAddress							<= Source;
+		DmaDataOut							<= (Control[3] == 1) ? {TransferData[7:0], TransferData[7:0]} : TransferData;
+		DmaAS_L								<= 1;
+		DmaUDS_L								<= 1;
+		DmaLDS_L								<= 1;
+		DmaWE_L								<= 1;
+
+		TransferDataLoad_H				<= 0;
+		TransferStep_H						<= 0;
+		TransferDone_H						<= 0;
+		TransferError_H					<= 0;
+		BurstCountReset_H					<= 0;
+		WaitCounterReset_H				<= 0;
+
+		NextState 							<= Idle ;										// default is to go to this state
+
+//////////////////////////////////////////////////////////////////
+// Nothing to do, or waiting for a paced request
+//////////////////////////////////////////////////////////////////
+
+		if(CurrentState == Idle) begin
+			BurstCountReset_H <= 1;
+			WaitCounterReset_H <= 1;
+			if (Control[0] == 1) begin
+				if (Count == 0)
+					TransferDone_H <= 1;
+				else if (Control[4] == 0 || DmaRequest_H == 1)
+					NextState <= WaitForBus;
+			end
+		end
+
+//////////////////////////////////////////////////////////////////
+// Stop the 68k as soon as it is between bus cycles, it stays
+// stopped from this clock on
+//////////////////////////////////////////////////////////////////
+
+		else if(CurrentState == WaitForBus) begin
+			WaitCounterReset_H <= 1;
+			if (Control[0] == 0)										//stopped by the 68k
+				NextState <= Idle;
+			else if (AS_L == 1) begin
+				CpuHold_H <= 1;
+				NextState <= ReadCycle;
+			end
+			else
+				NextState <= WaitForBus;
+		end
+
+//////////////////////////////////////////////////////////////////
+// Read the source, and keep its data when dtack comes back
+//////////////////////////////////////////////////////////////////
+
+		else if(CurrentState == ReadCycle) begin
+			CpuHold_H <= 1;
+			DmaBusOwner_H <= 1;
+			DmaAS_L <= 0;
+			DmaUDS_L <= (Control[3] == 1 && Source[0] == 1);
+			DmaLDS_L <= (Control[3] == 1 && Source[0] == 0);
+			NextState <= ReadCycle;
+			if (DmaDtack_L == 0) begin
+				TransferDataLoad_H <= 1;
+				NextState <= ReadEnd;
+			end
+			else if (WaitCounter >= TimeoutClocks) begin
+				TransferError_H <= 1;
+				NextState <= ReleaseBus;
+			end
+		end
+
+//////////////////////////////////////////////////////////////////
+// Address strobe high for a clock between our cycles
+//////////////////////////////////////////////////////////////////
+
+		else if(CurrentState == ReadEnd) begin
+			CpuHold_H <= 1;
+			DmaBusOwner_H <= 1;
+			WaitCounterReset_H <= 1;
+			NextState <= WriteCycle;
+		end
+
+//////////////////////////////////////////////////////////////////
+// Write the destination, the transfer is done when dtack comes back
+//////////////////////////////////////////////////////////////////
+
+		else if(CurrentState == WriteCycle) begin
+			CpuHold_H <= 1;
+			DmaBusOwner_H <= 1;
+			DmaAddress <= Destination;
+			DmaAS_L <= 0;
+			DmaWE_L <= 0;
+			DmaUDS_L <= (Control[3] == 1 && Destination[0] == 1);
+			DmaLDS_L <= (Control[3] == 1 && Destination[0] == 0);
+			NextState <= WriteCycle;
+			if (DmaDtack_L == 0) begin
+				TransferStep_H <= 1;
+				NextState <= WriteEnd;
+			end
+			else if (WaitCounter >= TimeoutClocks) begin
+				TransferError_H <= 1;
+				NextState <= ReleaseBus;
+			end
+		end
+
+//////////////////////////////////////////////////////////////////
+// Address strobe high, then the next transfer or give the bus back
+//////////////////////////////////////////////////////////////////
+
+		else if(CurrentState == WriteEnd) begin
+			CpuHold_H <= 1;
+			DmaBusOwner_H <= 1;
+			DmaAddress <= Destination;
+			WaitCounterReset_H <= 1;
+			if (Control[0] == 1 && Count != 0 && Control[4] == 0 && BurstCount < BurstTransfers)
+				NextState <= ReadCycle;
+			else
+				NextState <= ReleaseBus;
+		end
+
+//////////////////////////////////////////////////////////////////
+// 68k has the bus again, let it start a cycle before we think
+// about taking it back
+//////////////////////////////////////////////////////////////////
+
+		else if(CurrentState == ReleaseBus) begin
+			NextState <= ReleaseBus;
+			if (CpuCycleSeen_H == 1 || WaitCounter >= GapClocks)
+				NextState <= Idle;
+		end
+	end
+endmodule
@@ -78,16 +78,68 @@ void IIC_Init(void)
 	Control_Reg = 0x80;
 }
 
+/*************************************************************
+** a page write leaves the EEPROM busy for up to 5ms. Rather
+** than poll straight after the STOP, the next access's START
+** does the polling, so it only costs time if we come back
+** before the write has finished. Everything that ends with a
+** write's STOP sets eepromBusy.
+** Returns 0, or -1 (after a STOP) if the EEPROM does not
+** answer when it is not busy writing
+**************************************************************/
+int eepromBusy;
+
+int eepromStart(unsigned int blockN)
+{
+    TXRX_Reg = blockN;
+    ComSta_Reg = 0x90;  //STA, WR bit
+    while ((ComSta_Reg & (char)(0x02)) != (char)(0x00)) {}  //wait for TIP bit to be 0
+    while (eepromBusy && (ComSta_Reg & (char)(0x80)) != (char)(0x00)) {  //no ACK, still writing: ask again
+        TXRX_Reg = blockN;
+        ComSta_Reg = 0x90;
+        while ((ComSta_Reg & (char)(0x02)) != (char)(0x00)) {}
+    }
+    eepromBusy = 0;
+    if ((ComSta_Reg & (char)(0x80)) != (char)(0x00)) {
+        ComSta_Reg = 0x40;  //STO
+        while ((ComSta_Reg & (char)(0x02)) != (char)(0x00)) {}
+        printf("\nNo ACK from EEPROM 0x%02x", blockN);
+        return -1;
+    }
+    return 0;
+}
+
+/*************************************************************
+** send a byte (address or data) with command cmd, WR or
+** STO|WR, and check the EEPROM ACKed it. Waits on TIP only,
+** a NACK leaves RxACK set for good and would hang a wait on
+** both bits. Returns 0, or -1 after a STOP on a NACK
+**************************************************************/
+int eepromSend(unsigned int data, unsigned int cmd)
+{
+    TXRX_Reg = data;
+    ComSta_Reg = cmd;
+    while ((ComSta_Reg & (char)(0x02)) != (char)(0x00)) {}  //wait for TIP bit to be 0
+    if ((ComSta_Reg & (char)(0x80)) != (char)(0x00)) {      //RxACK: no ACK
+        if ((cmd & 0x40) == 0) {
+            ComSta_Reg = 0x40;  //STO
+            while ((ComSta_Reg & (char)(0x02)) != (char)(0x00)) {}
+        }
+        printf("\nNo ACK from EEPROM");
+        return -1;
+    }
+    return 0;
+}
+
 void byteWrite(unsigned int i, unsigned int addr, unsigned int data)
 {
     unsigned int blockN;
     if (i == (char)('0')) {blockN = 0xA0;} //slave addr: 1010_000 + W: 0, block 0
     else {blockN = 0xA8;}        //slave addr: 1010_100 + W: 0, block 1
 
-    //specify slave addr
-    TXRX_Reg = blockN;
-    ComSta_Reg = 0x90;  //STA, WR bit
-    while ((ComSta_Reg & (char)(0x82)) != (char)(0x00)) {}  //wait for ACK & TIP bit to be 0
+    //specify slave addr, waits for the last write if need be
+    if (eepromStart(blockN) != 0)
+        return;
 
     //specify addr
     TXRX_Reg = (addr & 0xFF00) / 0x100;
@@ -98,21 +150,11 @@ void byteWrite(unsigned int i, unsigned int addr, unsigned int data)
     ComSta_Reg = 0x10;  //WR bit
     while ((ComSta_Reg & (char)(0x82)) != (char)(0x00)) {}
 
-    //write data
+    //write data, the next access's START polls for the end of the write
     TXRX_Reg = data;
     ComSta_Reg = 0x50;  //STOP, WR bit
     while ((ComSta_Reg & (char)(0x82)) != (char)(0x00)) {}
-
-    //polling
-    TXRX_Reg = blockN;
-    ComSta_Reg = 0x90;
-
-    while ((ComSta_Reg & (char)(0x82)) != (char)(0x00)) {
-        TXRX_Reg = blockN;
-        ComSta_Reg = 0x90;
-    }
-    TXRX_Reg = blockN;
-    ComSta_Reg = 0x18;
+    eepromBusy = 1;
     printf("\nWrite to 0x%c%04x: %02x", i, addr, data);
 }
 
@@ -123,9 +165,8 @@ void byteRead(char i, unsigned int addr)
     else {blockN = 0xA8; blockRN = 0xA9;}        //slave addr: 1010_100 + W: 0, block 1
     printf("\n%x %x", addr / 256, addr % 256);
     //specify slave addr
-    TXRX_Reg = blockN;
-    ComSta_Reg = 0x90;  //STA, WR bit
-    while ((ComSta_Reg & (char)(0x82)) != (char)(0x00)) {}
+    if (eepromStart(blockN) != 0)
+        return;
 
     //specify addr
     TXRX_Reg = (addr & 0xFF00) / 0x100;
@@ -158,107 +199,870 @@ void byteRead(char i, unsigned int addr)
 
 }
 
-void callPageWrite(unsigned int i, unsigned int addr, unsigned int size, unsigned int fill)
+/*************************************************************
+** Write count bytes from buf: split at the 128 byte page
+** boundaries (which are also the block boundary) into the
+** longest page writes possible. addr is 17 bit, 0x10000 and up
+** is block 1. Returns with the last page still being written,
+** or -1 if the EEPROM did not answer
+**************************************************************/
+int writeBuffer(unsigned long addr, unsigned char *buf, unsigned long count)
 {
-    if (addr < 0x10000 && addr + size > 0x10000) {
-        pageWrite('0', addr, 0x10000 - addr, fill);
-        pageWrite('1', 0, size - 0x10000 + addr, fill);
+    unsigned int blockN;
+    unsigned long n;
+
+    while (count > 0) {
+        blockN = (addr & 0x10000) ? 0xA8 : 0xA0;    //slave addr: 1010_B00 + W: 0, B = block
+        n = 128 - (addr % 128);                     //rest of this page
+        if (n > count)
+            n = count;
+        count -= n;
+
+        //specify slave addr, waits for the last page if need be
+        if (eepromStart(blockN) != 0)
+            return -1;
+
+        //specify addr
+        if (eepromSend((addr & 0xFF00) / 0x100, 0x10) != 0 || eepromSend(addr & 0xFF, 0x10) != 0)   //WR bit
+            return -1;
+
+        addr += n;
+        for (; n > 1; n--)
+            if (eepromSend(*buf++, 0x10) != 0)
+                return -1;
+        if (eepromSend(*buf++, 0x50) != 0)      //final for sending STOP, WR bit
+            return -1;
+        eepromBusy = 1;
     }
-    else {
-        pageWrite(i, addr, size, fill);
+    return 0;
+}
+
+int callPageWrite(unsigned int i, unsigned int addr, unsigned long size, unsigned int fill)
+{
+    unsigned char buf[128];
+    unsigned long start, n;
+
+    memset(buf, fill, sizeof(buf));
+    start = addr + ((i == (char)('0')) ? 0 : 0x10000);
+    if (size > 0x20000 - start)     //stop at the end of block 1
+        size = 0x20000 - start;
+    while (size > 0) {
+        n = 128 - (start % 128);    //a page at a time, so each writeBuffer is one page write
+        if (n > size)
+            n = size;
+        if (writeBuffer(start, buf, n) != 0)
+            return -1;
+        start += n;
+        size -= n;
     }
+    return 0;
 }
-void pageWrite(unsigned int i, unsigned int addr, unsigned int size, unsigned int fill)
+
+/*************************************************************
+** Sequential read: address the EEPROM once, then clock out
+** count bytes into buf, ACKing every byte but the last.
+** addr is 17 bit (0x10000 and up is block 1), a read running
+** off the end of block 0 is restarted at the start of block 1.
+** Returns 0, or -1 if the EEPROM did not answer
+**************************************************************/
+int seqRead(unsigned long addr, unsigned char *buf, unsigned long count)
 {
-    unsigned int j, flag, blockN, addrRem, sizeRem, rem;
-    if (i == (char)('0')) {blockN = 0xA0;} //slave addr: 1010_000 + W: 0, block 0
-    else {blockN = 0xA8;}        //slave addr: 1010_100 + W: 0, block 1
+    unsigned int blockN;
+    unsigned long n;
 
-//n blocks
-    flag = 1;
-    j = addr;
-    while (flag) {
-        TXRX_Reg = blockN;
-        ComSta_Reg = 0x90;  //STA, WR bit
-        while ((ComSta_Reg & (char)(0x82)) != (char)(0x00)) {}  //wait for ACK & TIP bit to be 0
+    while (count > 0) {
+        blockN = (addr & 0x10000) ? 0xA8 : 0xA0;    //slave addr: 1010_B00 + W: 0, B = block
+        n = 0x10000 - (addr & 0xFFFF);              //bytes left in this block
+        if (n > count)
+            n = count;
+        count -= n;
+
+        //specify slave addr
+        if (eepromStart(blockN) != 0)
+            return -1;
 
         //specify addr
-        TXRX_Reg = (j & 0xFF00) / 0x100;
-        ComSta_Reg = 0x10;  //WR bit
-        while ((ComSta_Reg & (char)(0x82)) != (char)(0x00)) {}
-        TXRX_Reg = j & 0xFF;
-        ComSta_Reg = 0x10;  //WR bit
-        while ((ComSta_Reg & (char)(0x82)) != (char)(0x00)) {}
+        if (eepromSend((addr & 0xFF00) / 0x100, 0x10) != 0 || eepromSend(addr & 0xFF, 0x10) != 0)   //WR bit
+            return -1;
 
-        for (j; (j % 128) < 127; j++) {   //loops until 2nd last bit
-            TXRX_Reg = fill;
-            ComSta_Reg = 0x10;  //WR bit
-            while ((ComSta_Reg & (char)(0x82)) != (char)(0x00)) {}
+        //repeated START, read
+        if (eepromSend(blockN | 1, 0x90) != 0)  //STA, WR bit
+            return -1;
+
+        addr += n;
+        for (; n > 1; n--) {
+            ComSta_Reg = 0x20;  //RD bit, we ACK so the EEPROM carries on
+            while ((ComSta_Reg & (char)(0x02)) != (char)(0x00)) {}  //TIP only, RxACK is our own ACK now
+            *buf++ = TXRX_Reg;
         }
-        TXRX_Reg = fill;        //final for sending STOP
-        ComSta_Reg = 0x50;  //STOP, WR bit
-        while ((ComSta_Reg & (char)(0x82)) != (char)(0x00)) {}
-        //polling
-        TXRX_Reg = blockN;
-        ComSta_Reg = 0x90;
-        while ((ComSta_Reg & (char)(0x82)) != (char)(0x00)) {
-            TXRX_Reg = blockN;
-            ComSta_Reg = 0x90;
+        ComSta_Reg = 0x68;  //RD, NACK, STO for the last byte
+        while ((ComSta_Reg & (char)(0x02)) != (char)(0x00)) {}
+        *buf++ = TXRX_Reg;
+    }
+    return 0;
+}
+
+/*************************************************************
+** Read back count bytes with sequential reads and compare
+** them with buf, returns the number that differ
+**************************************************************/
+unsigned long verifyBuffer(unsigned long addr, unsigned char *buf, unsigned long count)
+{
+    unsigned char chunk[256];
+    unsigned long n, j, errors = 0;
+
+    while (count > 0) {
+        n = (count > sizeof(chunk)) ? sizeof(chunk) : count;
+        if (seqRead(addr, chunk, n) != 0)
+            return errors + count;      //couldn't read the rest, all wrong
+        for (j = 0; j < n; j++)
+            if (chunk[j] != buf[j])
+                errors++;
+        addr += n;
+        buf += n;
+        count -= n;
+    }
+    return errors;
+}
+
+/*************************************************************
+** RAM page cache in front of the EEPROM: CachePages 128 byte
+** pages, least recently used one replaced. Reads come from
+** RAM once a page is loaded, writes only change the RAM copy
+** and mark it dirty (unless the bytes are already there), so
+** many small updates to a page cost one page write, done when
+** the page is replaced or by cacheSync(). Anything written
+** through the cache must be cacheSync()ed before power off,
+** and the uncached functions above must not be used on
+** cached pages in between. The functions return 0, or -1 if
+** the EEPROM didn't answer; a page that couldn't be written
+** stays dirty, one that couldn't be read isn't cached
+**************************************************************/
+#define CachePages 16
+
+struct {
+    unsigned long Page;         //EEPROM address / 128
+    unsigned char Valid;
+    unsigned char Dirty;
+    unsigned long LastUse;      //cacheClock when last read or written
+    unsigned char Data[128];
+} eepromCache[CachePages];
+
+unsigned long cacheClock;
+unsigned long cachePageWrites;  //page writes done by the cache, to compare with the number of cacheWrite calls
+
+int cacheWritePage(int p)
+{
+    if (writeBuffer(eepromCache[p].Page * 128, eepromCache[p].Data, 128) != 0)
+        return -1;              //still dirty, try again on the next replace or sync
+    eepromCache[p].Dirty = 0;
+    cachePageWrites++;
+    return 0;
+}
+
+/*************************************************************
+** find the page in the cache, or bring it in replacing an
+** empty or the least recently used entry. load = 0 when the
+** caller is about to overwrite the whole page. Returns the
+** entry, or -1 if the victim couldn't be written back or the
+** page couldn't be read
+**************************************************************/
+int cachePage(unsigned long page, int load)
+{
+    int p, victim = 0;
+
+    for (p = 0; p < CachePages; p++) {
+        if (eepromCache[p].Valid && eepromCache[p].Page == page) {
+            eepromCache[p].LastUse = ++cacheClock;
+            return p;
         }
-        TXRX_Reg = blockN;
-        ComSta_Reg = 0x18;
-        j++;
-        if ((size - (j - addr)) / 128 == 0) {
-            flag = 0;
+        if (!eepromCache[p].Valid)
+            victim = p;
+        else if (eepromCache[victim].Valid && eepromCache[p].LastUse < eepromCache[victim].LastUse)
+            victim = p;
+    }
+
+    if (eepromCache[victim].Valid && eepromCache[victim].Dirty)
+        if (cacheWritePage(victim) != 0)
+            return -1;
+    if (load && seqRead(page * 128, eepromCache[victim].Data, 128) != 0) {
+        eepromCache[victim].Valid = 0;  //Data is part read, don't use it
+        return -1;
+    }
+    eepromCache[victim].Page = page;
+    eepromCache[victim].Valid = 1;
+    eepromCache[victim].Dirty = 0;
+    eepromCache[victim].LastUse = ++cacheClock;
+    return victim;
+}
+
+int cacheRead(unsigned long addr, unsigned char *buf, unsigned long count)
+{
+    unsigned long n;
+    int p;
+
+    while (count > 0) {
+        n = 128 - (addr % 128);
+        if (n > count)
+            n = count;
+        if ((p = cachePage(addr / 128, 1)) < 0)
+            return -1;
+        memcpy(buf, &eepromCache[p].Data[addr % 128], n);
+        addr += n;
+        buf += n;
+        count -= n;
+    }
+    return 0;
+}
+
+int cacheWrite(unsigned long addr, unsigned char *buf, unsigned long count)
+{
+    unsigned long n;
+    int p;
+
+    while (count > 0) {
+        n = 128 - (addr % 128);
+        if (n > count)
+            n = count;
+        if ((p = cachePage(addr / 128, n != 128)) < 0)
+            return -1;
+        if (n == 128 || memcmp(&eepromCache[p].Data[addr % 128], buf, n) != 0) {    //no write (or wear) for unchanged bytes
+            memcpy(&eepromCache[p].Data[addr % 128], buf, n);
+            eepromCache[p].Dirty = 1;
         }
+        addr += n;
+        buf += n;
+        count -= n;
     }
+    return 0;
+}
 
-//last block
-    rem = (size - (j - addr)) % 128;
-    printf("\n%x %x", rem, j);
-    if (rem > 0) {
-        TXRX_Reg = blockN;
-        ComSta_Reg = 0x90;  //STA, WR bit
-        while ((ComSta_Reg & (char)(0x82)) != (char)(0x00)) {}  //wait for ACK & TIP bit to be 0
+int cacheSync(void)
+{
+    unsigned long lowest;
+    int p, next;
 
-        //specify addr
-        TXRX_Reg = (j & 0xFF00) / 0x100;
-        ComSta_Reg = 0x10;  //WR bit
-        while ((ComSta_Reg & (char)(0x82)) != (char)(0x00)) {}
-        TXRX_Reg = j & 0xFF;
-        ComSta_Reg = 0x10;  //WR bit
-        while ((ComSta_Reg & (char)(0x82)) != (char)(0x00)) {}
+    do {                        //in address order, so the EEPROM sees one pass over the pages
+        next = -1;
+        for (p = 0; p < CachePages; p++)
+            if (eepromCache[p].Valid && eepromCache[p].Dirty && (next < 0 || eepromCache[p].Page < lowest)) {
+                next = p;
+                lowest = eepromCache[p].Page;
+            }
+        if (next >= 0 && cacheWritePage(next) != 0)
+            return -1;          //the rest stay dirty too
+    } while (next >= 0);
+    return 0;
+}
+
+/*************************************************************
+** Record store: an append only log of one page records over
+** the whole EEPROM (both blocks), so it must not share the
+** EEPROM with the cache or the menu's writes. A record is
+**
+**      0       0x5A
+**      1-4     sequence number, counts up, never reused
+**      5-6     log tail (oldest page still in use) when written
+**      7-8     key
+**      9       data length, RecordDeleted for a deletion
+**      10-125  data
+**      126-127 CRC16 (CCITT) of bytes 0-125
+**
+** Appending is one page write at the head of the log, each
+** one wearing a different page. The newest record for every
+** key is kept in RAM (storeIndex), so lookups never use the
+** bus. storeInit rebuilds it with one sequential read of the
+** EEPROM, noting each page's sequence number and key: the
+** record with the highest sequence number gives the head and
+** the tail, and only records between the two count. Going
+** through those in order replays the appends and deletions,
+** so no more than StoreKeys are ever live at once, then the
+** newest record of each live key is read back. When the log has wrapped round to its tail,
+** compaction moves the tail on, copying any record that is
+** still the newest for its key to the head first
+**************************************************************/
+#define StorePages      1024        //128K of 128 byte pages
+#define StoreKeys       64          //most live keys, storeAppend refuses any more
+#define StoreReserve    2           //free pages compaction keeps for copying records forward
+#define RecordMagic     0x5A
+#define RecordData      116         //most data bytes in a record
+#define RecordDeleted   0xFF
+
+struct {
+    unsigned int Key;
+    unsigned int Page;              //where its newest record is
+    unsigned long Seq;              //0 = entry not in use
+    unsigned char Len;
+    unsigned char Data[RecordData];
+} storeIndex[StoreKeys];
+
+unsigned long storePageSeq[StorePages];     //storeInit's scan: 0 = no good record
+unsigned int storePageKey[StorePages];
+unsigned char storePageLen[StorePages];
+
+unsigned int storeHead;             //next page to write
+unsigned int storeTail;             //oldest page still in the log
+unsigned int storeUsed;             //pages from tail to head
+unsigned long storeSeq;             //last sequence number used
+
+unsigned int crc16(unsigned char *p, int n)
+{
+    unsigned int crc = 0xFFFF;
+    int b;
+
+    while (n-- > 0) {
+        crc ^= (unsigned int)(*p++) << 8;
+        for (b = 0; b < 8; b++)
+            crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) & 0xFFFF : (crc << 1) & 0xFFFF;
+    }
+    return crc;
+}
+
+int storeFind(unsigned int key)
+{
+    int k;
+
+    for (k = 0; k < StoreKeys; k++)
+        if (storeIndex[k].Seq != 0 && storeIndex[k].Key == key)
+            return k;
+    return -1;
+}
 
-        for (j= 0; j < rem; j++) {   //loops until 2nd last bit
-            TXRX_Reg = fill;
-            ComSta_Reg = 0x10;  //WR bit
-            while ((ComSta_Reg & (char)(0x82)) != (char)(0x00)) {}
+/*************************************************************
+** write a record at the head of the log and note it in RAM
+**************************************************************/
+int storeWriteRecord(unsigned int key, unsigned char *data, unsigned int len)
+{
+    unsigned char rec[128];
+    unsigned int crc;
+    int k;
+
+    //find the key's entry, or room for it, before anything is written
+    k = storeFind(key);
+    if (k < 0 && len != RecordDeleted) {
+        for (k = 0; k < StoreKeys && storeIndex[k].Seq != 0; k++)
+            ;
+        if (k == StoreKeys)
+            return -1;
+    }
+
+    memset(rec, 0xFF, sizeof(rec));
+    rec[0] = RecordMagic;
+    storeSeq++;
+    rec[1] = storeSeq >> 24; rec[2] = storeSeq >> 16; rec[3] = storeSeq >> 8; rec[4] = storeSeq;
+    rec[5] = storeTail >> 8; rec[6] = storeTail;
+    rec[7] = key >> 8; rec[8] = key;
+    rec[9] = len;
+    if (len != RecordDeleted)
+        memcpy(&rec[10], data, len);
+    crc = crc16(rec, 126);
+    rec[126] = crc >> 8; rec[127] = crc;
+    if (writeBuffer((unsigned long)storeHead * 128, rec, 128) != 0)
+        return -1;
+
+    if (len == RecordDeleted) {
+        if (k >= 0)
+            storeIndex[k].Seq = 0;
+    }
+    else {
+        storeIndex[k].Key = key;
+        storeIndex[k].Page = storeHead;
+        storeIndex[k].Seq = storeSeq;
+        storeIndex[k].Len = len;
+        memcpy(storeIndex[k].Data, data, len);
+    }
+    storeHead = (storeHead + 1) % StorePages;
+    storeUsed++;
+    return 0;
+}
+
+/*************************************************************
+** move the tail on a page, copying its record to the head if
+** it is still the newest for its key (deletions are dropped:
+** every older record of the key is behind them already)
+**************************************************************/
+int storeCompactOne(void)
+{
+    unsigned char data[RecordData];
+    int k;
+
+    for (k = 0; k < StoreKeys; k++)
+        if (storeIndex[k].Seq != 0 && storeIndex[k].Page == storeTail)
+            break;
+    storeTail = (storeTail + 1) % StorePages;
+    storeUsed--;
+    if (k < StoreKeys) {
+        memcpy(data, storeIndex[k].Data, storeIndex[k].Len);
+        return storeWriteRecord(storeIndex[k].Key, data, storeIndex[k].Len);
+    }
+    return 0;
+}
+
+/*************************************************************
+** copy every live record forward, leaving only them in the log
+**************************************************************/
+int storeCompact(void)
+{
+    unsigned int n = storeUsed;
+
+    while (n-- > 0)
+        if (storeCompactOne() != 0)
+            return -1;
+    return 0;
+}
+
+int storeAppend(unsigned int key, unsigned char *data, unsigned int len)
+{
+    int k;
+
+    if (len > RecordData)
+        return -1;
+    if (storeFind(key) < 0) {
+        for (k = 0; k < StoreKeys && storeIndex[k].Seq != 0; k++)
+            ;
+        if (k == StoreKeys)
+            return -1;                  //no room in the index for another key
+    }
+    while (StorePages - storeUsed < StoreReserve)
+        if (storeCompactOne() != 0)
+            return -1;
+    return storeWriteRecord(key, data, len);
+}
+
+int storeDelete(unsigned int key)
+{
+    if (storeFind(key) < 0)
+        return -1;
+    while (StorePages - storeUsed < StoreReserve)
+        if (storeCompactOne() != 0)
+            return -1;
+    return storeWriteRecord(key, 0, RecordDeleted);
+}
+
+/*************************************************************
+** copy a key's data into buf, returns its length or -1 if
+** there is no such key. RAM only
+**************************************************************/
+int storeRead(unsigned int key, unsigned char *buf)
+{
+    int k = storeFind(key);
+
+    if (k < 0)
+        return -1;
+    memcpy(buf, storeIndex[k].Data, storeIndex[k].Len);
+    return storeIndex[k].Len;
+}
+
+/*************************************************************
+** rebuild the index from the EEPROM, returns the number of
+** keys, or -1 if the EEPROM can't be read or holds more live
+** keys than the index has room for
+**************************************************************/
+int storeInit(void)
+{
+    unsigned char chunk[1024];          //8 pages per read
+    unsigned char *rec;
+    unsigned int page, newestPage = 0, newestTail = 0, n;
+    int k, keys;
+
+    memset(storeIndex, 0, sizeof(storeIndex));
+    storeSeq = 0;
+    for (page = 0; page < StorePages; page++) {
+        if ((page % 8) == 0 && seqRead((unsigned long)page * 128, chunk, sizeof(chunk)) != 0)
+            return -1;
+        rec = &chunk[(page % 8) * 128];
+        storePageSeq[page] = 0;
+        if (rec[0] != RecordMagic || crc16(rec, 126) != ((unsigned int)rec[126] << 8 | rec[127]))
+            continue;
+        storePageSeq[page] = ((unsigned long)rec[1] << 24) | ((unsigned long)rec[2] << 16) | ((unsigned long)rec[3] << 8) | rec[4];
+        storePageKey[page] = (rec[7] << 8) | rec[8];
+        storePageLen[page] = rec[9];
+        if (storePageSeq[page] > storeSeq) {
+            storeSeq = storePageSeq[page];
+            newestPage = page;
+            newestTail = (rec[5] << 8) | rec[6];
+        }
+    }
+
+    if (storeSeq == 0) {                //empty (or never used) EEPROM
+        storeHead = storeTail = storeUsed = 0;
+        return 0;
+    }
+    storeHead = (newestPage + 1) % StorePages;
+    storeTail = newestTail;
+    storeUsed = (storeHead + StorePages - storeTail) % StorePages;
+
+    //replay the log from the tail, anything before it is left over from the last time round
+    for (n = 0; n < storeUsed; n++) {
+        page = (storeTail + n) % StorePages;
+        if (storePageSeq[page] == 0)
+            continue;
+        k = storeFind(storePageKey[page]);
+        if (storePageLen[page] == RecordDeleted) {
+            if (k >= 0)
+                storeIndex[k].Seq = 0;
+            continue;
+        }
+        if (k < 0) {
+            for (k = 0; k < StoreKeys && storeIndex[k].Seq != 0; k++)
+                ;
+            if (k == StoreKeys) {
+                printf("\nMore than %d live keys in the log", StoreKeys);
+                return -1;
+            }
+        }
+        storeIndex[k].Key = storePageKey[page];
+        storeIndex[k].Page = page;
+        storeIndex[k].Seq = storePageSeq[page];
+    }
+
+    //read back the newest record of each live key
+    keys = 0;
+    for (k = 0; k < StoreKeys; k++) {
+        if (storeIndex[k].Seq == 0)
+            continue;
+        if (seqRead((unsigned long)storeIndex[k].Page * 128, chunk, 128) != 0)
+            return -1;
+        storeIndex[k].Len = (chunk[9] > RecordData) ? RecordData : chunk[9];
+        memcpy(storeIndex[k].Data, &chunk[10], storeIndex[k].Len);
+        keys++;
+    }
+    return keys;
+}
+
+/*************************************************************
+** Loader: programs the EEPROM from S-records (S1/S2/S3 data,
+** S7/S8/S9 to finish) or binary frames sent at full speed:
+**
+**      0x02, 3 byte address, length, data, checksum
+**
+** where a length of 0 finishes. Both checksums are the ones
+** complement of the sum of the other bytes. Nothing is echoed.
+**
+** Received characters go into loadRing as soon as they arrive
+** (the 6850 holds only one), bytes are gathered a page at a
+** time into one of loadPages while the other is programmed
+** by loadStep, which does one IIC transfer each time it is
+** called rather than waiting for them. XOFF is only sent if
+** the ring fills up because programming has fallen behind
+**************************************************************/
+#define XON             0x11
+#define XOFF            0x13
+#define RingSize        1024
+#define RingXoff        512         //send XOFF at this many, leaving room for what the PC has already sent
+#define RingXon         128
+#define LoadPolls       200         //ACK polls (about 90us each) before a page write is given up on
+#define LoadRetries     3           //tries at a page before it is counted as an error
+
+unsigned char loadRing[RingSize];
+unsigned int ringIn, ringOut;
+int loadXoff;
+unsigned long loadOverruns;
+
+struct {
+    unsigned long Addr;
+    unsigned int Count;
+    unsigned char Data[128];
+} loadPages[2];
+
+int loadFill;                   //page being filled
+int loadWriting;                //page being programmed, -1 if none
+int loadState, loadIndex;       //loadStep's progress through it
+int loadPolls, loadRetries;
+
+unsigned char loadRec[260];     //record being received, after the S and type (or 0x02)
+unsigned int loadLen, loadNeed;
+char loadType;                  //'0'-'9' for S-records, 'B' for a binary frame, 0 between records
+int loadHigh;                   //S-records: a high nibble is waiting in loadRec[loadLen]
+int loadDone;
+unsigned long loadBytes, loadRecords, loadErrors;
+
+void loadPoll(void)
+{
+    unsigned char status = RS232_Status;
+
+    if (status & 0x01) {
+        if ((status & 0x20) || (ringIn + 1) % RingSize == ringOut)    //6850 or ring overrun
+            loadOverruns++;
+        loadRing[ringIn] = RS232_RxData;    //all 8 bits, unlike _getch
+        if ((ringIn + 1) % RingSize != ringOut)
+            ringIn = (ringIn + 1) % RingSize;
+    }
+    if ((status & 0x02) != 0) {             //transmitter free for XON/XOFF
+        if (loadXoff == 0 && (ringIn - ringOut) % RingSize >= RingXoff) {
+            RS232_TxData = XOFF;
+            loadXoff = 1;
+        }
+        else if (loadXoff && (ringIn - ringOut) % RingSize <= RingXon) {
+            RS232_TxData = XON;
+            loadXoff = 0;
         }
-        TXRX_Reg = fill;        //final for sending STOP
-        ComSta_Reg = 0x50;  //STOP, WR bit
-        while ((ComSta_Reg & (char)(0x82)) != (char)(0x00)) {}
-        //polling
+    }
+}
+
+/*************************************************************
+** one IIC transfer of the page being programmed, if the last
+** has finished. The START ACK polls the previous page's write.
+** Any other byte not ACKed (or polling for too long) gets a
+** STOP and the page is started again, LoadRetries times
+**************************************************************/
+void loadStep(void)
+{
+    unsigned int blockN;
+    unsigned char status;
+
+    if (loadWriting < 0)
+        return;
+    status = ComSta_Reg;
+    if ((status & (char)(0x02)) != (char)(0x00))  //TIP
+        return;
+    blockN = (loadPages[loadWriting].Addr & 0x10000) ? 0xA8 : 0xA0;
+    if (loadState >= 2 && loadState != 4 && (status & (char)(0x80)) != (char)(0x00)) {  //address or data byte not ACKed
+        if (loadState == 2 || loadIndex < loadPages[loadWriting].Count)
+            ComSta_Reg = 0x40;  //STO, unless it went with the last byte
+        loadState = 4;
+        return;
+    }
+    if (loadState == 0) {
         TXRX_Reg = blockN;
-        ComSta_Reg = 0x90;
-        while ((ComSta_Reg & (char)(0x82)) != (char)(0x00)) {
+        ComSta_Reg = 0x90;  //STA, WR bit
+        loadPolls = 0;
+        loadState = 1;
+    }
+    else if (loadState == 1) {
+        if ((status & (char)(0x80)) != (char)(0x00)) {  //no ACK, still writing: ask again
+            if (++loadPolls >= LoadPolls) {
+                ComSta_Reg = 0x40;  //STO
+                loadState = 4;
+                return;
+            }
             TXRX_Reg = blockN;
             ComSta_Reg = 0x90;
+            return;
+        }
+        TXRX_Reg = (loadPages[loadWriting].Addr & 0xFF00) / 0x100;
+        ComSta_Reg = 0x10;  //WR bit
+        loadState = 2;
+    }
+    else if (loadState == 2) {
+        TXRX_Reg = loadPages[loadWriting].Addr & 0xFF;
+        ComSta_Reg = 0x10;  //WR bit
+        loadIndex = 0;
+        loadState = 3;
+    }
+    else if (loadState == 4) {  //STOP after a failure is done
+        loadState = 0;
+        if (++loadRetries >= LoadRetries) {
+            loadErrors++;
+            loadRetries = 0;
+            loadWriting = -1;
+        }
+    }
+    else if (loadIndex < loadPages[loadWriting].Count) {
+        TXRX_Reg = loadPages[loadWriting].Data[loadIndex];
+        loadIndex++;
+        ComSta_Reg = (loadIndex == loadPages[loadWriting].Count) ? 0x50 : 0x10;  //STOP with the last
+    }
+    else {
+        loadWriting = -1;
+        loadRetries = 0;
+        loadState = 0;
+    }
+}
+
+/*************************************************************
+** hand the page being filled over to loadStep, waiting for
+** the other one to finish if need be
+**************************************************************/
+void loadFlush(void)
+{
+    if (loadPages[loadFill].Count == 0)
+        return;
+    while (loadWriting >= 0) {
+        loadPoll();
+        loadStep();
+    }
+    loadWriting = loadFill;
+    loadFill ^= 1;
+    loadPages[loadFill].Count = 0;
+}
+
+void loadByte(unsigned long addr, unsigned char b)
+{
+    loadPoll();                         //a long record mustn't let the 6850 overrun
+    loadStep();
+    if (addr >= 0x20000) {
+        loadErrors++;
+        return;
+    }
+    //a page write has to be one run of bytes within the page
+    if (loadPages[loadFill].Count != 0 && addr != loadPages[loadFill].Addr + loadPages[loadFill].Count)
+        loadFlush();
+    if (loadPages[loadFill].Count == 0)
+        loadPages[loadFill].Addr = addr;
+    loadPages[loadFill].Data[loadPages[loadFill].Count++] = b;
+    loadBytes++;
+    if ((addr % 128) == 127)            //end of the page, start programming it now
+        loadFlush();
+}
+
+void loadRecord(void)
+{
+    unsigned int sum = 0, j, addrLen;
+    unsigned long addr = 0;
+
+    for (j = 0; j < loadLen; j++) {
+        sum += loadRec[j];
+        if ((j % 32) == 0)
+            loadPoll();
+    }
+    if ((sum & 0xFF) != 0xFF) {
+        loadErrors++;
+        return;
+    }
+    loadRecords++;
+    if (loadType == 'B') {
+        if (loadRec[3] == 0)
+            loadDone = 1;
+        addrLen = 3;
+        j = 0;                          //address starts the frame
+    }
+    else if (loadType >= '1' && loadType <= '3') {
+        addrLen = loadType - '0' + 1;
+        j = 1;                          //after the count
+    }
+    else {
+        if (loadType >= '7')
+            loadDone = 1;
+        return;                         //S0 header, S5/S6 counts
+    }
+    for (addrLen += j; j < addrLen; j++)
+        addr = (addr << 8) | loadRec[j];
+    if (loadType == 'B')
+        j++;                            //skip the length
+    for (; j < loadLen - 1; j++)
+        loadByte(addr++, loadRec[j]);
+}
+
+void loadChar(unsigned char c)
+{
+    if (loadType == 0) {                //between records
+        if (c == 0x02) {
+            loadType = 'B';
+            loadLen = 0;
+            loadNeed = 4;               //address and length, then we know the rest
+        }
+        else if (c == 'S')
+            loadType = 'S';
+    }
+    else if (loadType == 'S') {         //type digit
+        loadType = (c >= '0' && c <= '9') ? c : 0;
+        loadLen = 0;
+        loadNeed = 1;                   //count, then we know the rest
+        loadHigh = 0;
+    }
+    else if (loadType == 'B') {
+        loadRec[loadLen++] = c;
+        if (loadLen == 4)
+            loadNeed = 4 + loadRec[3] + 1;
+        if (loadLen == loadNeed) {
+            loadRecord();
+            loadType = 0;
+        }
+    }
+    else if (isxdigit(c) == 0) {        //S-record cut short
+        loadErrors++;
+        loadType = 0;
+    }
+    else if (loadHigh == 0) {
+        loadRec[loadLen] = xtod(c) << 4;
+        loadHigh = 1;
+    }
+    else {
+        loadRec[loadLen++] |= xtod(c);
+        loadHigh = 0;
+        if (loadLen == 1)
+            loadNeed = 1 + loadRec[0];
+        if (loadLen == loadNeed) {
+            loadRecord();
+            loadType = 0;
         }
-        TXRX_Reg = blockN;
-        ComSta_Reg = 0x18;
     }
 }
 
+void loader(void)
+{
+    ringIn = ringOut = 0;
+    loadXoff = 0;
+    loadFill = 0;
+    loadWriting = -1;
+    loadState = loadRetries = 0;
+    loadPages[0].Count = loadPages[1].Count = 0;
+    loadType = 0;
+    loadDone = 0;
+    loadBytes = loadRecords = loadErrors = loadOverruns = 0;
+
+    printf("\nSend S-records or binary frames...");
+    while (loadDone == 0) {
+        loadPoll();
+        loadStep();
+        if (ringIn != ringOut) {
+            loadChar(loadRing[ringOut]);
+            ringOut = (ringOut + 1) % RingSize;
+        }
+    }
+    loadFlush();
+    while (loadWriting >= 0) {
+        loadPoll();
+        loadStep();
+    }
+    eepromBusy = 1;                     //last page still being written
+    if (loadXoff)
+        _putch(XON);
+    printf("\n%lu bytes in %lu records, %lu bad records or pages not written, %lu overruns", loadBytes, loadRecords, loadErrors, loadOverruns);
+}
+
+void dumpBytes(unsigned int i, unsigned int addr, unsigned long size)
+{
+    unsigned char buf[256];
+    unsigned long start, n, j;
+
+    start = addr + ((i == (char)('0')) ? 0 : 0x10000);
+    while (size > 0) {
+        n = (size > sizeof(buf)) ? sizeof(buf) : size;
+        seqRead(start, buf, n);
+        for (j = 0; j < n; j++) {
+            if ((j % 16) == 0)
+                printf("\n%05lx:", start + j);
+            printf(" %02x", buf[j]);
+        }
+        start += n;
+        size -= n;
+    }
+}
+
+unsigned char image[0x20000];     //whole EEPROM's worth, for test patterns
+
 void main(void)
 {
     unsigned char i;
     unsigned int addr, data, size, fill;
+    unsigned long start, j;
+    int storeReady = 0, len;
 
     IIC_Init();
     while (1) {
         printf("\n0: Write single byte");
         printf("\n1: Read single byte");
         printf("\n2: Write pages");
+        printf("\n3: Read bytes");
+        printf("\n4: Write test pattern and verify");
+        printf("\n5: Cached write byte");
+        printf("\n6: Cached read byte");
+        printf("\n7: Sync cache");
+        printf("\n8: Store record");
+        printf("\n9: Read record");
+        printf("\nL: Load S-records or binary");
         i = _getch();
         if (i == (char)('0')) {
             printf("\nWrite to block 0 or 1: ");
@@ -285,7 +1089,88 @@ void main(void)
             size = Get6HexDigits(0);
             printf("\nFill with: ");
             fill = Get2HexDigits(0);
-            callPageWrite(i, addr, size, fill);
+            if (callPageWrite(i, addr, size, fill) != 0)
+                printf("\nWrite failed");
+        }
+        else if (i == (char)('3')) {
+            printf("\nStart at block 0 or 1: ");
+            i = _getch();
+            printf("\nStart hex address: ");
+            addr = Get4HexDigits(0);
+            printf("\nHow many bytes (6 hex digits): ");
+            size = Get6HexDigits(0);
+            dumpBytes(i, addr, size);
+        }
+        else if (i == (char)('4')) {
+            printf("\nStart at block 0 or 1: ");
+            i = _getch();
+            printf("\nStart hex address: ");
+            addr = Get4HexDigits(0);
+            printf("\nHow many bytes (6 hex digits, up to 20000): ");
+            size = Get6HexDigits(0);
+            if (size > sizeof(image))
+                size = sizeof(image);
+            start = addr + ((i == (char)('0')) ? 0 : 0x10000);
+            if (size > 0x20000 - start)     //stop at the end of block 1
+                size = 0x20000 - start;
+            for (j = 0; j < size; j++)
+                image[j] = (unsigned char)((start + j) ^ ((start + j) >> 8));
+            if (writeBuffer(start, image, size) != 0)
+                printf("\nWrite failed");
+            else
+                printf("\n%lx bytes written, %lu differ", (unsigned long)size, verifyBuffer(start, image, size));
+        }
+        else if (i == (char)('5') || i == (char)('6')) {
+            fill = i;
+            printf("\nBlock 0 or 1: ");
+            i = _getch();
+            printf("\nHex address: ");
+            addr = Get4HexDigits(0);
+            start = addr + ((i == (char)('0')) ? 0 : 0x10000);
+            if (fill == (char)('5')) {
+                printf("\nData: ");
+                image[0] = Get2HexDigits(0);
+                if (cacheWrite(start, image, 1) != 0)
+                    printf("\nCan't write 0x%05lx", start);
+            }
+            else if (cacheRead(start, image, 1) != 0)
+                printf("\nCan't read 0x%05lx", start);
+            else
+                printf("\nRead 0x%05lx: %02x", start, image[0]);
+        }
+        else if (i == (char)('7')) {
+            if (cacheSync() != 0)
+                printf("\nCan't write back all the dirty pages");
+            printf("\n%lu page writes so far", cachePageWrites);
+        }
+        else if (i == (char)('L') || i == (char)('l'))
+            loader();
+        else if (i == (char)('8') || i == (char)('9')) {
+            if (storeReady == 0) {
+                printf("\nScanning EEPROM...");
+                if ((len = storeInit()) < 0) {
+                    printf("\nCan't use the record store");
+                    continue;
+                }
+                printf(" %d records", len);
+                storeReady = 1;
+            }
+            fill = i;
+            printf("\nHex key: ");
+            data = Get4HexDigits(0);
+            if (fill == (char)('8')) {
+                printf("\nText: ");
+                for (j = 0; j < RecordData && (i = _getch()) != '\r'; j++)
+                    image[j] = i;
+                if (storeAppend(data, image, j) != 0)
+                    printf("\nCan't store record");
+            }
+            else if ((len = storeRead(data, image)) < 0)
+                printf("\nNo record");
+            else {
+                image[len] = 0;
+                printf("\n%04x: %s", data, image);
+            }
         }
     }
 }
\ No newline at end of file
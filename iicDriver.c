@@ -0,0 +1,461 @@
+#include <stdio.h>
+#include <Bios.h>
+#include <ucos_ii.h>
+
+/*************************************************************
+** Interrupt driven IIC driver for the 24LC1025 EEPROM under uCOS-II
+**
+** Tasks queue transactions (IIC_Submit) or call the blocking
+** IIC_EEPROMRead/IIC_EEPROMWrite, and the IIC controller's
+** interrupt (IF, set when each byte or command completes) steps
+** a state machine through the address phase, the data and the
+** EEPROM's ACK polling after each page write, so the CPU runs
+** other tasks instead of spinning on TIP. ACK polling is a
+** repeated START + slave address until the EEPROM answers,
+** roughly 60 short interrupts over the 5ms a page write takes
+**
+** EEPROM addresses are 17 bit: 0x00000 - 0x0FFFF is block 0
+** (slave 0xA0), 0x10000 - 0x1FFFF block 1 (slave 0xA8).
+** Writes are split at the 128 byte page boundaries, reads at
+** the block boundary, so a transaction can be any length
+**************************************************************/
+
+#define STACKSIZE  256
+
+//#define StartOfExceptionVectorTable 0x08030000
+#define StartOfExceptionVectorTable 0x0B000000
+
+// IIC Registers
+#define ClockPrescale_l         (*(volatile unsigned char *)(0x00408000))   //8 bits each
+#define ClockPrescale_h          (*(volatile unsigned char *)(0x00408002))
+#define Control_Reg            (*(volatile unsigned char *)(0x00408004))
+#define TXRX_Reg             (*(volatile unsigned char *)(0x00408006))
+#define ComSta_Reg              (*(volatile unsigned char *)(0x00408008))
+
+// command register bits (write ComSta_Reg)
+#define IIC_STA     0x80
+#define IIC_STO     0x40
+#define IIC_RD      0x20
+#define IIC_WR      0x10
+#define IIC_NACK    0x08        // ACK bit: 1 = don't acknowledge the byte read (the last one)
+#define IIC_IACK    0x01
+
+// status register bits (read ComSta_Reg)
+#define IIC_RXACK   0x80        // 1 = slave did not acknowledge
+#define IIC_AL      0x20        // arbitration lost
+
+#define IIC_VECTOR      29      // level 5 autovector, where the IIC controller's IRQ is wired
+#define IIC_PAGE        128     // 24LC1025 page size
+#define IIC_MAX_POLLS   200     // ACK polls (about 90us each at 100KHz) before giving up on a write
+#define IIC_WAITERS     4       // tasks that can be blocked in IIC_EEPROMRead/Write at once
+#define IIC_TIMEOUT(n)  (OS_TICKS_PER_SEC + (unsigned long)(n) * OS_TICKS_PER_SEC / 1000)  // 1s + 1ms a byte, 4 times a page write's worst case
+
+// transaction status
+#define IIC_PENDING     0
+#define IIC_DONE        1
+#define IIC_ERROR       2       // no acknowledge, arbitration lost or the EEPROM never finished a write
+
+typedef struct IIC_Transaction {
+    unsigned long Address;                              // 17 bit EEPROM address, advances as the transfer runs
+    unsigned char *Data;                                // advances as the transfer runs
+    unsigned int Count;                                 // bytes left
+    unsigned char Read;                                 // 1 = read Count bytes into Data, 0 = write them from Data
+    volatile unsigned char Status;                      // IIC_PENDING until done
+    void (*Callback)(struct IIC_Transaction *);         // called from the interrupt when done, may be 0
+    OS_EVENT *Done;                                     // semaphore posted when done, may be 0
+    struct IIC_Transaction *Next;
+} IIC_Transaction;
+
+// interrupt state machine
+#define IIC_Idle            0
+#define IIC_SlaveSent       1       // slave address (write) sent, send address high byte
+#define IIC_AddrHighSent    2
+#define IIC_AddrLowSent     3       // write: send data, read: repeated start with the read slave address
+#define IIC_DataSent        4
+#define IIC_ReadSlaveSent   5
+#define IIC_DataRead        6
+#define IIC_Polling         7       // START + slave sent after a page write, waiting for the EEPROM to ACK it
+#define IIC_StopSent        8       // end of a page's ACK polling or a read, go on or finish
+
+static IIC_Transaction *IICHead, *IICTail;             // queue, IICHead is the one in progress
+static volatile unsigned char IICState;
+static unsigned int IICPageBytes;                       // bytes of the current write left before its STOP
+static unsigned int IICPolls;
+
+// semaphores handed out to tasks blocked in the IIC_EEPROM calls
+static OS_EVENT *IICWaitSem[IIC_WAITERS];
+static unsigned char IICWaitFree;                        // bit n = IICWaitSem[n] free
+static OS_EVENT *IICPoolSem;                             // counts free semaphores
+
+OS_STK Task1Stk[STACKSIZE];
+OS_STK Task2Stk[STACKSIZE];
+
+#define HEX_A        *(volatile unsigned char *)(0x00400010)
+#define HEX_B        *(volatile unsigned char *)(0x00400012)
+
+void Task1(void *);
+void Task2(void *);
+void IIC_ISR(void);             // iicDriver_a.asm
+
+static unsigned char IIC_Slave(unsigned long addr)
+{
+    return (addr & 0x10000) ? 0xA8 : 0xA0;              // slave addr: 1010_B00 + W: 0, B = block
+}
+
+/*************************************************************
+** start the transaction at the head of the queue, or
+** the next page/part of it: START and the slave address
+**************************************************************/
+static void IIC_StartTransaction(IIC_Transaction *t)
+{
+    if (t->Read == 0) {
+        IICPageBytes = IIC_PAGE - (t->Address % IIC_PAGE);    // up to the end of this page
+        if (IICPageBytes > t->Count)
+            IICPageBytes = t->Count;
+    }
+    TXRX_Reg = IIC_Slave(t->Address);
+    ComSta_Reg = IIC_STA | IIC_WR;
+    IICState = IIC_SlaveSent;
+}
+
+/*************************************************************
+** take the finished transaction off the queue, tell whoever
+** is waiting and start the next one. Interrupt level only
+**************************************************************/
+static void IIC_Finish(unsigned char status)
+{
+    IIC_Transaction *t = IICHead;
+
+    IICHead = t->Next;
+    if (IICHead == 0)
+        IICTail = 0;
+    t->Status = status;
+    if (t->Callback)
+        t->Callback(t);
+    if (t->Done)
+        OSSemPost(t->Done);
+
+    if (IICHead)
+        IIC_StartTransaction(IICHead);
+    else
+        IICState = IIC_Idle;
+}
+
+/*************************************************************
+** IIC controller interrupt: the command given last time has
+** completed, give the next one. Called from IIC_ISR in
+** iicDriver_a.asm, which saves the registers, counts the
+** interrupt in OSIntNesting and calls OSIntExit afterwards
+**************************************************************/
+void IIC_Service(void)
+{
+    IIC_Transaction *t;
+    unsigned char status, last;
+
+    status = ComSta_Reg;
+    ComSta_Reg = IIC_IACK;                              // clear IF
+    t = IICHead;
+
+    if (t == 0 || IICState == IIC_Idle) {
+        return;
+    }
+
+    if (status & IIC_AL) {                              // someone else on the bus, the controller has let go of it
+        IIC_Finish(IIC_ERROR);
+        return;
+    }
+
+    // the EEPROM must acknowledge everything we send apart from the polls, where no ACK means still busy
+    if ((status & IIC_RXACK) && IICState != IIC_Polling && IICState != IIC_DataRead && IICState != IIC_StopSent) {
+        ComSta_Reg = IIC_STO;
+        IICState = IIC_StopSent;
+        t->Count = 0;
+        t->Status = IIC_ERROR;                          // noted here, IIC_Finish after the STOP
+        return;
+    }
+
+    switch (IICState) {
+        case IIC_SlaveSent:
+            TXRX_Reg = (t->Address & 0xFF00) / 0x100;
+            ComSta_Reg = IIC_WR;
+            IICState = IIC_AddrHighSent;
+            break;
+
+        case IIC_AddrHighSent:
+            TXRX_Reg = t->Address & 0xFF;
+            ComSta_Reg = IIC_WR;
+            IICState = IIC_AddrLowSent;
+            break;
+
+        case IIC_AddrLowSent:
+            if (t->Read) {
+                TXRX_Reg = IIC_Slave(t->Address) | 1;   // repeated START, read
+                ComSta_Reg = IIC_STA | IIC_WR;
+                IICState = IIC_ReadSlaveSent;
+                break;
+            }
+            // fall through, first data byte
+        case IIC_DataSent:
+            if (IICPageBytes == 0) {                    // page done and STOP sent with the last byte, poll until written
+                IICPolls = 0;
+                TXRX_Reg = IIC_Slave(t->Address - 1);
+                ComSta_Reg = IIC_STA | IIC_WR;
+                IICState = IIC_Polling;
+                break;
+            }
+            TXRX_Reg = *t->Data++;
+            t->Address++;
+            t->Count--;
+            IICPageBytes--;
+            ComSta_Reg = (IICPageBytes == 0) ? (IIC_STO | IIC_WR) : IIC_WR;
+            IICState = IIC_DataSent;
+            break;
+
+        case IIC_ReadSlaveSent:
+        case IIC_DataRead:
+            if (IICState == IIC_DataRead) {
+                *t->Data++ = TXRX_Reg;
+                t->Address++;
+                t->Count--;
+                if (t->Count == 0 || (t->Address & 0xFFFF) == 0) {     // last byte had NACK + STOP
+                    IICState = IIC_StopSent;
+                    if (t->Count == 0)
+                        IIC_Finish(IIC_DONE);
+                    else
+                        IIC_StartTransaction(t);        // on into the next block
+                    break;
+                }
+            }
+            last = (t->Count == 1 || ((t->Address + 1) & 0xFFFF) == 0);
+            ComSta_Reg = last ? (IIC_RD | IIC_NACK | IIC_STO) : IIC_RD;
+            IICState = IIC_DataRead;
+            break;
+
+        case IIC_Polling:
+            if (status & IIC_RXACK) {                   // still writing, ask again
+                if (++IICPolls >= IIC_MAX_POLLS) {
+                    ComSta_Reg = IIC_STO;
+                    IICState = IIC_StopSent;
+                    t->Count = 0;
+                    t->Status = IIC_ERROR;
+                    break;
+                }
+                TXRX_Reg = IIC_Slave(t->Address - 1);
+                ComSta_Reg = IIC_STA | IIC_WR;
+            }
+            else {
+                ComSta_Reg = IIC_STO;                   // written, free the bus
+                IICState = IIC_StopSent;
+            }
+            break;
+
+        case IIC_StopSent:
+            if (t->Status == IIC_ERROR)
+                IIC_Finish(IIC_ERROR);
+            else if (t->Count == 0)
+                IIC_Finish(IIC_DONE);
+            else
+                IIC_StartTransaction(t);                // next page
+            break;
+    }
+}
+
+void IIC_DriverInit(void)
+{
+    volatile long int *RamVectorAddress = (volatile long int *)(StartOfExceptionVectorTable);
+    int i;
+
+    IICHead = IICTail = 0;
+    IICState = IIC_Idle;
+    RamVectorAddress[IIC_VECTOR] = (long int)(IIC_ISR);
+
+    IICPoolSem = OSSemCreate(IIC_WAITERS);
+    IICWaitFree = 0;
+    for (i = 0; i < IIC_WAITERS; i++) {
+        IICWaitSem[i] = OSSemCreate(0);
+        IICWaitFree |= 1 << i;
+    }
+
+    ClockPrescale_l = 0x4F; //40MHz
+    ClockPrescale_h = 0x00;
+    Control_Reg = 0xC0;     //core and interrupt enabled
+}
+
+/*************************************************************
+** queue a transaction, returns straight away. Status says
+** IIC_PENDING until it is done, then Callback (from the
+** interrupt) and/or Done are used if set
+**************************************************************/
+void IIC_Submit(IIC_Transaction *t)
+{
+#if OS_CRITICAL_METHOD == 3
+    OS_CPU_SR cpu_sr;
+#endif
+
+    t->Status = IIC_PENDING;
+    t->Next = 0;
+    if (t->Count == 0) {
+        t->Status = IIC_DONE;
+        if (t->Callback)
+            t->Callback(t);
+        if (t->Done)
+            OSSemPost(t->Done);
+        return;
+    }
+
+    OS_ENTER_CRITICAL();
+    if (IICTail)
+        IICTail->Next = t;
+    else
+        IICHead = t;
+    IICTail = t;
+    if (IICState == IIC_Idle)
+        IIC_StartTransaction(t);
+    OS_EXIT_CRITICAL();
+}
+
+/*************************************************************
+** take a transaction that timed out off the queue. If it is
+** the one in progress, STOP the bus and let the STOP's
+** interrupt start the next one. Returns 1 if it was queued,
+** 0 if it finished (and posted Done) in the meantime
+**************************************************************/
+static unsigned char IIC_Cancel(IIC_Transaction *t)
+{
+#if OS_CRITICAL_METHOD == 3
+    OS_CPU_SR cpu_sr;
+#endif
+    IIC_Transaction *p, *prev = 0;
+
+    OS_ENTER_CRITICAL();
+    for (p = IICHead; p != 0 && p != t; p = p->Next)
+        prev = p;
+    if (p == 0) {
+        OS_EXIT_CRITICAL();
+        return 0;
+    }
+
+    if (prev)
+        prev->Next = t->Next;
+    else
+        IICHead = t->Next;
+    if (IICTail == t)
+        IICTail = prev;
+    if (prev == 0) {
+        ComSta_Reg = IIC_STO;                           // free the bus, IIC_StopSent then starts IICHead if there is one
+        IICState = IICHead ? IIC_StopSent : IIC_Idle;
+    }
+    t->Status = IIC_ERROR;
+    OS_EXIT_CRITICAL();
+    return 1;
+}
+
+/*************************************************************
+** blocking calls for tasks: the calling task sleeps until
+** the transfer is over, returns IIC_DONE or IIC_ERROR.
+** IIC_ERROR too if it isn't over in IIC_TIMEOUT ticks (the
+** controller has stopped interrupting), the transaction is
+** then cancelled
+**************************************************************/
+static unsigned char IIC_Wait(unsigned long addr, unsigned char *data, unsigned int count, unsigned char read)
+{
+#if OS_CRITICAL_METHOD == 3
+    OS_CPU_SR cpu_sr;
+#endif
+    IIC_Transaction t;
+    unsigned long timeout;
+    INT8U err;
+    int i;
+
+    OSSemPend(IICPoolSem, 0, &err);                     // wait for a free semaphore
+    OS_ENTER_CRITICAL();
+    for (i = 0; (IICWaitFree & (1 << i)) == 0; i++)
+        ;
+    IICWaitFree &= ~(1 << i);
+    OS_EXIT_CRITICAL();
+
+    t.Address = addr;
+    t.Data = data;
+    t.Count = count;
+    t.Read = read;
+    t.Callback = 0;
+    t.Done = IICWaitSem[i];
+    IIC_Submit(&t);
+    timeout = IIC_TIMEOUT(count);
+    OSSemPend(t.Done, (timeout > 65535) ? 65535 : (INT16U)(timeout), &err);
+    if (err == OS_TIMEOUT && IIC_Cancel(&t) == 0)
+        OSSemAccept(t.Done);                            // posted just after the timeout, leave the semaphore at 0
+
+    OS_ENTER_CRITICAL();
+    IICWaitFree |= 1 << i;
+    OS_EXIT_CRITICAL();
+    OSSemPost(IICPoolSem);
+    return t.Status;
+}
+
+unsigned char IIC_EEPROMRead(unsigned long addr, unsigned char *data, unsigned int count)
+{
+    return IIC_Wait(addr, data, count, 1);
+}
+
+unsigned char IIC_EEPROMWrite(unsigned long addr, unsigned char *data, unsigned int count)
+{
+    return IIC_Wait(addr, data, count, 0);
+}
+
+/*
+** demo: Task1 writes a pattern across a page boundary and reads it back
+** while Task2 keeps counting on the hex displays
+*/
+
+void main(void)
+{
+    Init_RS232();
+
+    OSInit();
+    IIC_DriverInit();
+
+    OSTaskCreate(Task1, OS_NULL, &Task1Stk[STACKSIZE], 12);
+    OSTaskCreate(Task2, OS_NULL, &Task2Stk[STACKSIZE], 11);     // highest priority task, starts the timer
+
+    OSStart();
+}
+
+void Task1(void *pdata)
+{
+    static unsigned char out[200], in[200];     // not on Task1's STACKSIZE word stack
+    unsigned long addr = 0x0FFA0;       // crosses pages and, for the read back, the block boundary
+    unsigned int i, errors;
+    unsigned char pass = 0;
+
+    for (;;) {
+        for (i = 0; i < sizeof(out); i++)
+            out[i] = (unsigned char)(i + pass);
+        if (IIC_EEPROMWrite(addr, out, sizeof(out)) != IIC_DONE)
+            printf("\nIIC write failed");
+        else if (IIC_EEPROMRead(addr, in, sizeof(in)) != IIC_DONE)
+            printf("\nIIC read failed");
+        else {
+            errors = 0;
+            for (i = 0; i < sizeof(in); i++)
+                if (in[i] != out[i])
+                    errors++;
+            printf("\nPass %d: %d bytes at %05lx, %d errors", pass, (int)sizeof(in), addr, errors);
+        }
+        pass++;
+        OSTimeDly(100);
+    }
+}
+
+void Task2(void *pdata)
+{
+    unsigned char count = 0;
+
+    Timer1_Init();      // this function is in BIOS.C and written by us to start timer
+
+    for (;;) {
+        HEX_A = HEX_B = count;
+        OSTimeDly(10);
+        count++;
+    }
+}
@@ -0,0 +1,41 @@
+*************************************************************
+* IIC controller interrupt entry for iicDriver.c under uCOS-II
+*
+* Built the same way as the port's OSTickISR in os_cpu_a.asm,
+* so OSIntExit can switch to a higher priority task made ready
+* by the interrupt (OSIntCtxSw expects D0-D7/A0-A6 on the stack
+* under the exception frame and returns with RTE):
+*
+*   save all the registers
+*   count the interrupt in OSIntNesting, and if it is the first
+*   level save the stack pointer in OSTCBCur->OSTCBStkPtr
+*   call IIC_Service (the C part, in iicDriver.c)
+*   call OSIntExit, which may not come back here until this
+*   task runs again
+*   restore the registers and RTE
+*
+* IIC_DriverInit puts IIC_ISR in the vector table
+*************************************************************
+
+        XREF    _OSIntNesting
+        XREF    _OSTCBCur
+        XREF    _OSIntExit
+        XREF    _IIC_Service
+        XDEF    _IIC_ISR
+
+        SECTION code
+
+_IIC_ISR:
+        MOVEM.L D0-D7/A0-A6,-(A7)       save the interrupted task's registers
+        ADDQ.B  #1,_OSIntNesting        OSIntNesting++
+        CMPI.B  #1,_OSIntNesting
+        BNE.S   IIC_ISR1                nested, already on an interrupt's stack
+        MOVEA.L _OSTCBCur,A1            OSTCBCur->OSTCBStkPtr = SP
+        MOVE.L  A7,(A1)
+IIC_ISR1:
+        JSR     _IIC_Service
+        JSR     _OSIntExit
+        MOVEM.L (A7)+,D0-D7/A0-A6
+        RTE
+
+        END
@@ -0,0 +1,538 @@
+///////////////////////////////////////////////////////////////////////////////////////
+// Trace driven software model of M68kAssociativeCacheController_Verilog, for sweeping
+// cache geometry, write policy and replacement policy over captured traces far faster
+// than the Verilator testbench can.
+//
+//		./CacheSim [-j threads] [-k sizes] [-w ways] [-l line words] [-m wt,wb]
+//					  [-r plru,lru,random,srrip] [-n count] [-s seed] [-t loop|stack] [trace]
+//		./CacheSim -c out.bin in.trace			convert a text trace to binary
+//
+// Sizes are in K bytes, every list is comma separated and every combination is run
+// (default 4,8,16 K x 2,4,8 ways x 4,8,16 words x wt,wb x all four policies, all of
+// them geometries the controller can be built as).
+// Without a trace file count (default 10 million) accesses of one of the synthetic
+// workloads in Trace.h are used (-t loop, the default, or stack). Traces are memory mapped and each thread walks through them a
+// block at a time, running all of its configurations over a block while it is in the
+// processor's cache, so the trace is streamed through memory once per thread.
+//
+// Timing follows the controller's state machine with the Dram model's timing (Models.h):
+// a read hit gets dtack the clock AS is seen (FastHitMode), a miss asserts the Dram
+// select the next clock and gets dtack when its word arrives (CriticalWordFirst) while
+// the rest of the line fills, write through writes are posted into a WriteBufferDepth
+// entry buffer that drains when the Dram is free, write back writes take 3 clocks on a
+// hit and dirty victims are written back a word at a time before the fill. Refresh
+// holds the Dram off for RefreshClocks every RefreshInterval. Pseudo LRU, LRU and SRRIP
+// update and pick victims as the controller does (without looking at the valid bits).
+// Random takes the controller's LFSR sequence at the model's clock, which is only close
+// to the controller's, so its victims are random but not the controller's. The prefetcher, victim buffer, way masks,
+// locked ways and uncached regions are not modelled, so the results are for the
+// controller with them off (prefetch disabled, VictimEntries = 0, the reset way masks
+// and no locked ways or uncached regions), which every run says
+///////////////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "Models.h"
+#include "Trace.h"
+
+enum WritePolicy { WriteThrough = 0, WriteBack = 1 };
+enum ReplacementPolicy { PLRUPolicy = 0, LRUPolicy = 1, RandomPolicy = 2, SRRIPPolicy = 3 };		// the controller's ReplacementPolicy values
+
+static const char *WritePolicyNames[] = {"wt", "wb"};
+static const char *ReplacementNames[] = {"plru", "lru", "random", "srrip"};
+
+const unsigned WriteBufferDepth = 4;
+const size_t BlockRecords = 1 << 16;							// 512K bytes of trace at a time
+
+struct Config {
+	unsigned Ways;
+	unsigned Sets;
+	unsigned LineWords;
+	WritePolicy Write;
+	ReplacementPolicy Replacement;
+};
+
+struct Stats {
+	uint64_t Reads = 0;
+	uint64_t ReadMisses = 0;
+	uint64_t Writes = 0;
+	uint64_t WriteMisses = 0;
+	uint64_t WriteBacks = 0;										// dirty lines copied back to Dram
+	uint64_t Other = 0;												// accesses outside Dram
+	uint64_t ReadClocks = 0;
+	uint64_t WriteClocks = 0;
+	uint64_t RefreshStalls = 0;
+	uint64_t Clocks = 0;
+};
+
+static unsigned Log2(unsigned Value)
+{
+	unsigned bits = 0;
+	while((1u << bits) < Value)
+		bits++;
+	return bits;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////
+// The controller's LFSR (RandomBits): reset to 0xACE1 and stepped every clock, so its
+// value at any clock can be looked up
+///////////////////////////////////////////////////////////////////////////////////////
+
+static std::vector<uint16_t> LfsrTable()
+{
+	std::vector<uint16_t> table(65535);
+	uint16_t bits = 0xACE1;
+	for(unsigned i = 0; i < table.size(); i++) {
+		table[i] = bits;
+		unsigned feedback = ((bits >> 15) ^ (bits >> 13) ^ (bits >> 12) ^ (bits >> 10)) & 1;
+		bits = (uint16_t)((bits << 1) | feedback);
+	}
+	return table;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////
+// Replacement functions, mirrors of PLRUAccess/PLRUVictim/LRUAccess/ReplacementHit/
+// ReplacementVictim/ReplacementFill in the controller. State is the set's StateBits
+///////////////////////////////////////////////////////////////////////////////////////
+
+class Replacement {
+public:
+	Replacement(ReplacementPolicy Policy, unsigned Ways) :
+		Policy(Policy), Ways(Ways), WayBits(Log2(Ways)), FieldBits(Policy == SRRIPPolicy ? 2 : Log2(Ways)) {}
+
+	uint64_t Hit(uint64_t State, unsigned Block) const
+	{
+		if(Policy == PLRUPolicy)
+			return PLRUAccess(State, Block);
+		if(Policy == LRUPolicy)
+			return LRUAccess(State, Block);
+		if(Policy == SRRIPPolicy)
+			return SetField(State, Block, 0);
+		return State;
+	}
+
+	unsigned Victim(uint64_t State, unsigned Allowed, uint16_t Random) const
+	{
+		if(Policy == PLRUPolicy) {
+			unsigned node = 0, first = 0, victim = 0;
+			for(int level = WayBits - 1; level >= 0; level--) {
+				unsigned side = (State >> node) & 1, span = 1u << level;
+				if(((Allowed >> (first + side * span)) & ((1u << span) - 1)) == 0)
+					side = 1 - side;
+				victim |= side << level;
+				first += side * span;
+				node = 2 * node + 1 + side;
+			}
+			return victim;
+		}
+		if(Policy == RandomPolicy) {
+			for(unsigned way = 0; way < Ways; way++) {
+				unsigned block = (Random + way) & (Ways - 1);
+				if(Allowed & (1u << block))
+					return block;
+			}
+			return 0;
+		}
+		unsigned victim = 0, oldest = 0;
+		bool found = false;
+		for(unsigned way = 0; way < Ways; way++)
+			if((Allowed & (1u << way)) && (!found || Field(State, way) > oldest)) {
+				oldest = Field(State, way);
+				victim = way;
+				found = true;
+			}
+		return victim;
+	}
+
+	uint64_t Fill(uint64_t State, unsigned Block, unsigned Allowed) const
+	{
+		if(Policy == PLRUPolicy)
+			return PLRUAccess(State, Block);
+		if(Policy == LRUPolicy)
+			return LRUAccess(State, Block);
+		if(Policy == SRRIPPolicy) {
+			unsigned age = 3 - Field(State, Block);
+			uint64_t next = State;
+			for(unsigned way = 0; way < Ways; way++)
+				if(Allowed & (1u << way))
+					next = SetField(next, way, (Field(State, way) + age) & 3);
+			return SetField(next, Block, 2);
+		}
+		return State;
+	}
+
+private:
+	unsigned Field(uint64_t State, unsigned Way) const { return (State >> (Way * FieldBits)) & ((1u << FieldBits) - 1); }
+
+	uint64_t SetField(uint64_t State, unsigned Way, unsigned Value) const
+	{
+		uint64_t mask = (uint64_t)((1u << FieldBits) - 1) << (Way * FieldBits);
+		return (State & ~mask) | ((uint64_t)Value << (Way * FieldBits));
+	}
+
+	uint64_t PLRUAccess(uint64_t Bits, unsigned Block) const
+	{
+		unsigned node = 0;
+		for(int level = WayBits - 1; level >= 0; level--) {
+			unsigned b = (Block >> level) & 1;
+			Bits = b ? (Bits & ~(1ull << node)) : (Bits | (1ull << node));
+			node = 2 * node + 1 + b;
+		}
+		return Bits;
+	}
+
+	uint64_t LRUAccess(uint64_t Ages, unsigned Block) const
+	{
+		uint64_t next = Ages;
+		for(unsigned way = 0; way < Ways; way++)
+			if(way != Block && Field(Ages, way) <= Field(Ages, Block) && Field(Ages, way) != Ways - 1)
+				next = SetField(next, way, Field(Ages, way) + 1);
+		return SetField(next, Block, 0);
+	}
+
+	ReplacementPolicy Policy;
+	unsigned Ways, WayBits, FieldBits;
+};
+
+///////////////////////////////////////////////////////////////////////////////////////
+// One cache configuration. Per set: Ways tags (line number + 1, 0 = invalid) side by
+// side, a dirty bit mask and the replacement state, so a lookup touches one or two
+// host cache lines
+///////////////////////////////////////////////////////////////////////////////////////
+
+class CacheModel {
+public:
+	CacheModel(const Config &C, const DramTiming &Timing, const std::vector<uint16_t> &Lfsr) :
+		C(C), Timing(Timing), Lfsr(Lfsr), Policy(C.Replacement, C.Ways),
+		LineShift(Log2(C.LineWords) + 1), IndexMask(C.Sets - 1),
+		Tags(C.Sets * C.Ways, 0), Dirty(C.Sets, 0), State(C.Sets, 0),
+		WriteClocks(1 + Timing.RasToCas + 1 + Timing.Precharge),
+		NextRefresh(Timing.RefreshInterval) {}
+
+	void Run(const TraceRecord *Records, size_t Count)
+	{
+		for(size_t i = 0; i < Count; i++)
+			Access(Records[i]);
+		S.Clocks = Now;
+	}
+
+	const Config &Configuration() const { return C; }
+	const Stats &Results() const { return S; }
+
+private:
+	void Access(const TraceRecord &r)
+	{
+		uint64_t t = Now + r.Gap;
+		if(!IsDram(r.Address)) {
+			S.Other++;
+			Now = t + 2;
+			return;
+		}
+
+		uint32_t line = r.Address >> LineShift;
+		unsigned set = line & IndexMask, word = (r.Address >> 1) & (C.LineWords - 1);
+		uint32_t *tags = &Tags[set * C.Ways];
+		bool write = TraceIsWrite(r);
+		uint64_t dtack;
+
+		// a read of the line being filled is given its word as soon as it has arrived (fill buffer)
+		if(!write && t < CacheFree && line == FillLine) {
+			dtack = std::max(t, FillFirstWord + ((word - FillStartWord) & (C.LineWords - 1)));
+			S.Reads++;
+			S.ReadClocks += dtack - t + 1;
+			Now = dtack + 2;
+			return;
+		}
+
+		uint64_t idle = std::max(t, CacheFree);					// state machine back in Idle
+		DrainWrites(idle);
+		int hit = -1;
+		for(unsigned way = 0; way < C.Ways; way++)
+			if(tags[way] == line + 1) {
+				hit = way;
+				break;
+			}
+
+		if(write && C.Write == WriteThrough) {						// write through: posted, a hit just updates the word
+			S.Writes++;
+			S.WriteMisses += (hit < 0);
+			if(Pending.size() == WriteBufferDepth) {				// buffer full, wait for the oldest to go
+				DrainWrites(~0ull, 1);
+				idle = std::max(idle, DramFree - Timing.Precharge);
+			}
+			Pending.push_back({line, idle + 1});
+			dtack = idle;
+			S.WriteClocks += dtack - t + 1;
+			CacheFree = dtack + 2;
+			Now = dtack + 2;
+			return;
+		}
+
+		if(hit >= 0) {
+			State[set] = Policy.Hit(State[set], hit);
+			if(write) {
+				S.Writes++;
+				Dirty[set] |= 1u << hit;
+				dtack = idle + 2;											// CheckForCacheHit, WriteDataToCache
+				S.WriteClocks += dtack - t + 1;
+			}
+			else {
+				S.Reads++;
+				dtack = idle;												// fast hit
+				S.ReadClocks += dtack - t + 1;
+			}
+			CacheFree = dtack + 2;
+			Now = dtack + 2;
+			return;
+		}
+
+		// miss: the victim was picked in Idle, with the LFSR as it was that clock (by the model's count)
+		unsigned allWays = (1u << C.Ways) - 1;
+		unsigned victim = Policy.Victim(State[set], allWays, Lfsr[idle % Lfsr.size()]);
+		State[set] = Policy.Fill(State[set], victim, allWays);
+
+		uint64_t select = idle + 1;
+		for(const PendingWrite &p : Pending)							// a buffered write to this line has to go first
+			if(p.Line == line) {
+				DrainWrites(~0ull, Pending.size());
+				break;
+			}
+		if(C.Write == WriteBack && (Dirty[set] >> victim) & 1) {	// copy the dirty victim back a word at a time
+			S.WriteBacks++;
+			select = idle + 2;
+			for(unsigned w = 0; w < C.LineWords; w++)
+				select = DramAcquire(select) + WriteClocks;
+			select++;
+		}
+		tags[victim] = line + 1;
+		Dirty[set] &= ~(1u << victim);
+
+		uint64_t ras = DramAcquire(select) + 1;
+		FillFirstWord = ras + Timing.RasToCas + Timing.CasLatency + 1;
+		FillStartWord = word;										// critical word first
+		FillLine = line;
+		uint64_t endBurst = FillFirstWord + C.LineWords + 1;		// EndBurstFill
+		DramFree = endBurst + Timing.Precharge;
+		CacheFree = endBurst + 1;
+
+		if(write) {														// write allocate, then write the word into the new line
+			S.Writes++;
+			S.WriteMisses++;
+			Dirty[set] |= 1u << victim;
+			dtack = endBurst + 1;
+			S.WriteClocks += dtack - t + 1;
+			CacheFree = dtack + 2;
+		}
+		else {
+			S.Reads++;
+			S.ReadMisses++;
+			dtack = FillFirstWord;
+			S.ReadClocks += dtack - t + 1;
+		}
+		Now = dtack + 2;
+	}
+
+	// first clock the Dram controller can open a row for a select seen at clock t, after any refresh due
+	uint64_t DramAcquire(uint64_t t)
+	{
+		t = std::max(t, DramFree);
+		while(NextRefresh <= t) {
+			uint64_t start = std::max(NextRefresh, DramFree);
+			DramFree = start + 1 + Timing.RefreshClocks;
+			if(DramFree > t) {
+				t = DramFree;
+				S.RefreshStalls++;
+			}
+			NextRefresh += Timing.RefreshInterval;
+		}
+		return t;
+	}
+
+	// drain buffered writes that can start before clock Before (or at least Minimum of them)
+	void DrainWrites(uint64_t Before, size_t Minimum = 0)
+	{
+		while(!Pending.empty()) {
+			uint64_t ready = std::max(Pending.front().Ready, DramFree);
+			if(ready >= Before && Minimum == 0)
+				break;
+			DramFree = DramAcquire(ready) + WriteClocks;
+			Pending.pop_front();
+			if(Minimum)
+				Minimum--;
+		}
+	}
+
+	struct PendingWrite {
+		uint32_t Line;
+		uint64_t Ready;
+	};
+
+	Config C;
+	DramTiming Timing;
+	const std::vector<uint16_t> &Lfsr;
+	Replacement Policy;
+	unsigned LineShift, IndexMask;
+	std::vector<uint32_t> Tags;
+	std::vector<uint16_t> Dirty;
+	std::vector<uint64_t> State;
+	unsigned WriteClocks;
+
+	Stats S;
+	uint64_t Now = 0;
+	uint64_t CacheFree = 0;											// clock the state machine is next in Idle
+	uint64_t DramFree = 0;											// clock the Dram controller can next take a select
+	uint64_t NextRefresh;
+	uint32_t FillLine = ~0u;
+	unsigned FillStartWord = 0;
+	uint64_t FillFirstWord = 0;
+	std::deque<PendingWrite> Pending;
+};
+
+///////////////////////////////////////////////////////////////////////////////////////
+
+static std::vector<unsigned> ParseList(const char *Text)
+{
+	std::vector<unsigned> values;
+	for(const char *p = Text; *p;) {
+		char *next;
+		values.push_back((unsigned)strtoul(p, &next, 0));
+		p = (*next == ',') ? next + 1 : next + strlen(next);
+	}
+	return values;
+}
+
+static bool ParseNames(const char *Text, const char *const *Names, unsigned Count, std::vector<unsigned> &Values)
+{
+	Values.clear();
+	std::string list(Text);
+	size_t start = 0;
+	while(start <= list.size()) {
+		size_t end = list.find(',', start);
+		std::string name = list.substr(start, end == std::string::npos ? std::string::npos : end - start);
+		unsigned i = 0;
+		while(i < Count && name != Names[i])
+			i++;
+		if(i == Count) {
+			fprintf(stderr, "unknown '%s'\n", name.c_str());
+			return false;
+		}
+		Values.push_back(i);
+		if(end == std::string::npos)
+			break;
+		start = end + 1;
+	}
+	return true;
+}
+
+static void Usage(const char *Program)
+{
+	fprintf(stderr, "usage: %s [-j threads] [-k sizes] [-w ways] [-l line words] [-m wt,wb] [-r plru,lru,random,srrip]\n"
+						 "          [-n count] [-s seed] [-t loop|stack] [trace]\n"
+						 "       %s -c out.bin in.trace\n", Program, Program);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+	std::vector<unsigned> sizes = {4, 8, 16}, ways = {2, 4, 8}, lines = {4, 8, 16};
+	std::vector<unsigned> writePolicies = {WriteThrough, WriteBack}, policies = {PLRUPolicy, LRUPolicy, RandomPolicy, SRRIPPolicy};
+	size_t count = 10000000;
+	uint32_t seed = 1;
+	const char *convert = nullptr;
+	bool stackWorkload = false;
+
+	int opt;
+	while((opt = getopt(argc, argv, "j:k:w:l:m:r:n:s:c:t:")) != -1) {
+		switch(opt) {
+			case 'j':	threads = std::max(1ul, strtoul(optarg, nullptr, 0)); break;
+			case 'k':	sizes = ParseList(optarg); break;
+			case 'w':	ways = ParseList(optarg); break;
+			case 'l':	lines = ParseList(optarg); break;
+			case 'm':	if(!ParseNames(optarg, WritePolicyNames, 2, writePolicies)) return 1; break;
+			case 'r':	if(!ParseNames(optarg, ReplacementNames, 4, policies)) return 1; break;
+			case 'n':	count = strtoull(optarg, nullptr, 0); break;
+			case 's':	seed = strtoul(optarg, nullptr, 0); break;
+			case 'c':	convert = optarg; break;
+			case 't':	stackWorkload = !strcmp(optarg, "stack"); break;
+			default:		Usage(argv[0]); return 1;
+		}
+	}
+
+	TraceFile trace;
+	if(optind < argc) {
+		if(!trace.Open(argv[optind]))
+			return 1;
+	}
+	else
+		trace.Use(stackWorkload ? GenerateStackTrace(count, seed) : GenerateTrace(count, seed));
+	if(convert)
+		return WriteBinaryTrace(convert, trace.begin(), trace.size()) ? 0 : 1;
+
+	// every combination the controller can be built as
+	std::vector<Config> configs;
+	for(unsigned k : sizes)
+		for(unsigned w : ways)
+			for(unsigned l : lines) {
+				unsigned sets = (w && l) ? k * 1024 / (w * l * 2) : 0;
+				if(w < 2 || w > 16 || (w & (w - 1)) || (l != 4 && l != 8 && l != 16) || sets < 2 || sets > 1024 || (sets & (sets - 1)) ||
+					sets * w * l * 2 != k * 1024) {
+					fprintf(stderr, "skipping %uK %u way %u word lines: not a geometry the controller supports\n", k, w, l);
+					continue;
+				}
+				for(unsigned m : writePolicies)
+					for(unsigned r : policies)
+						configs.push_back({w, sets, l, (WritePolicy)m, (ReplacementPolicy)r});
+			}
+	if(configs.empty())
+		return 1;
+
+	DramTiming timing;
+	std::vector<uint16_t> lfsr = LfsrTable();
+	std::vector<CacheModel> models;
+	models.reserve(configs.size());
+	for(const Config &c : configs) {
+		DramTiming t = timing;
+		t.BurstWords = c.LineWords;
+		models.emplace_back(c, t, lfsr);
+	}
+
+	// each thread takes every threads'th model and runs them all over the trace a block at a time
+	threads = std::min<unsigned>(threads, models.size());
+	std::vector<std::thread> workers;
+	for(unsigned id = 0; id < threads; id++)
+		workers.emplace_back([&, id]() {
+			for(size_t start = 0; start < trace.size(); start += BlockRecords) {
+				size_t n = std::min(BlockRecords, trace.size() - start);
+				for(size_t m = id; m < models.size(); m += threads)
+					models[m].Run(trace.begin() + start, n);
+			}
+		});
+	for(std::thread &w : workers)
+		w.join();
+
+	printf("%zu accesses, Dram CAS latency %u, RAS to CAS %u, refresh every %u clocks, %u entry write buffer\n",
+			 trace.size(), timing.CasLatency, timing.RasToCas, timing.RefreshInterval, WriteBufferDepth);
+	printf("not modelled: prefetcher, victim buffer, way masks, locked ways, uncached regions (results are for a build\n"
+			 "with VictimEntries = 0, prefetch off, reset way masks and nothing locked or uncached)\n\n");
+	printf("  Size  Ways  Sets  Line  Write  Replace  ReadMiss%%  WriteMiss%%  WriteBacks     Clocks  Clk/Access  ReadLat  WriteLat\n");
+	for(const CacheModel &m : models) {
+		const Config &c = m.Configuration();
+		const Stats &s = m.Results();
+		size_t accesses = s.Reads + s.Writes + s.Other;
+		printf("%5uK  %4u  %4u  %4u  %5s  %7s  %9.3f  %10.3f  %10llu  %9llu  %10.3f  %7.2f  %8.2f\n",
+				 c.Ways * c.Sets * c.LineWords * 2 / 1024, c.Ways, c.Sets, c.LineWords, WritePolicyNames[c.Write], ReplacementNames[c.Replacement],
+				 s.Reads ? 100.0 * s.ReadMisses / s.Reads : 0.0, s.Writes ? 100.0 * s.WriteMisses / s.Writes : 0.0,
+				 (unsigned long long)s.WriteBacks, (unsigned long long)s.Clocks, accesses ? (double)s.Clocks / accesses : 0.0,
+				 s.Reads ? (double)s.ReadClocks / s.Reads : 0.0, s.Writes ? (double)s.WriteClocks / s.Writes : 0.0);
+	}
+	return 0;
+}
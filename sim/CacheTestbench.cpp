@@ -0,0 +1,690 @@
+///////////////////////////////////////////////////////////////////////////////////////
+// Verilator testbench for M68kAssociativeCacheController_Verilog
+//
+// Puts the controller in the same surroundings as AssociativeDramCache.bdf (cache set
+// memories, PseudoLRU_Bits memory, Dram controller with CAS latency and refresh, see
+// Models.h), replays a 68k bus trace into it clock by clock and reports hit rate,
+// read/write latency and clocks per access. Every word the 68k reads from Dram is
+// checked against what the trace has written, so a broken controller fails the run.
+//
+//		make						build with the default geometry (see Makefile for parameters)
+//		./obj_dir/CacheTestbench [-n count] [-s seed] [-r refresh] [-l cas] [-t loop|stack] [-d log] [trace]
+//		./obj_dir/CacheTestbench -c	directed checks of the features (see RunChecks), make check runs
+//									them write through and write back
+//
+// Without a trace file it runs count (default 200000) accesses of one of the synthetic
+// workloads in Trace.h (-t loop, the default, or stack). Accesses outside Dram and the cache registers are given a
+// dtack straight away, as on chip memory would. The controller's CASDelay1/2 states only fit a CAS
+// latency of 2, so -l takes nothing else. -d logs the clock each access starts on and its clocks to
+// dtack, one access a line, so two builds of the controller can be diffed for timing
+///////////////////////////////////////////////////////////////////////////////////////
+
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include <unistd.h>
+
+#include "verilated.h"
+#include "VM68kAssociativeCacheController_Verilog.h"
+
+#include "Models.h"
+#include "Trace.h"
+
+// must match the parameters the controller was verilated with (the Makefile passes both)
+#ifndef WAYS
+#define WAYS 8
+#endif
+#ifndef SETS
+#define SETS 128
+#endif
+#ifndef LINE_WORDS
+#define LINE_WORDS 8
+#endif
+#ifndef WRITE_BACK
+#define WRITE_BACK 0
+#endif
+#ifndef VICTIM_ENTRIES
+#define VICTIM_ENTRIES 0
+#endif
+#ifndef WRITE_BUFFER_DEPTH
+#define WRITE_BUFFER_DEPTH 4
+#endif
+
+const uint32_t CacheRegBase = 0x00409000;
+
+typedef VM68kAssociativeCacheController_Verilog Controller;
+
+static bool IsCacheReg(uint32_t Address) { return (Address & 0xFFFFFF00) == CacheRegBase; }
+
+///////////////////////////////////////////////////////////////////////////////////////
+// Everything around the controller, stepped one clock at a time
+///////////////////////////////////////////////////////////////////////////////////////
+
+class Testbench {
+public:
+	Testbench(VerilatedContext *Context, const DramTiming &Timing) :
+		Top(new Controller(Context)), Dram(Timing), Lru(SETS, 0)
+	{
+		for(unsigned way = 0; way < WAYS; way++)
+			Ways.emplace_back(SETS, LINE_WORDS);
+		Top->Clock = 0;
+		Top->AS_L = 1;
+		Top->UDS_L = 1;
+		Top->LDS_L = 1;
+		Top->WE_L = 1;
+		Top->FC = 1;
+		Top->SnoopCycle_H = 0;								// the 68k is the bus master unless Access says otherwise
+		Reset();
+	}
+
+	~Testbench() { Top->final(); }
+
+	// pulses Reset_L, the memories (and so anything locked or dirty in them) keep their contents
+	void Reset()
+	{
+		Top->Reset_L = 0;
+		for(int i = 0; i < 4; i++)
+			Clock();
+		Top->Reset_L = 1;
+		for(int i = 0; i < 4; i++)
+			Clock();
+	}
+
+	void Idle(unsigned Clocks)
+	{
+		for(unsigned i = 0; i < Clocks; i++)
+			Clock();
+	}
+
+	// one complete bus cycle (after Gap idle clocks), returns the clocks from AS to dtack.
+	// Snoop makes it a DMA controller's cycle (SnoopCycle_H) instead of the 68k's
+	unsigned Access(const TraceRecord &r, uint16_t *ReadData, bool Snoop = false)
+	{
+		for(unsigned i = 0; i < r.Gap; i++)
+			Clock();
+
+		bool write = TraceIsWrite(r);
+		bool byte = (r.Op & TraceOpMask) == TraceWriteByte;
+		Top->AddressBusInFrom68k = r.Address & ~1u;
+		Top->DataBusInFrom68k = byte ? (uint16_t)((r.Data & 0xFF) * 0x0101) : r.Data;		// a byte goes out on both halves
+		Top->FC = TraceFunctionCode(r);
+		Top->WE_L = !write;
+		Top->UDS_L = byte && (r.Address & 1);
+		Top->LDS_L = byte && !(r.Address & 1);
+		Top->SnoopCycle_H = Snoop;
+		Top->AS_L = 0;
+		Top->DramSelect68k_H = IsDram(r.Address);
+		Top->CacheRegSelect_H = IsCacheReg(r.Address);
+
+		unsigned clocks = 0;
+		bool other = !IsDram(r.Address) && !IsCacheReg(r.Address);
+		for(;;) {
+			clocks++;
+			Settle();
+			bool dtack = other || !Top->DtackTo68k_L || !Top->CacheRegDtack_L;
+			uint16_t data = Top->CacheRegSelect_H ? Top->CacheRegDataOut : Top->DataBusOutTo68k;
+			Clock(false);
+			if(dtack) {
+				if(ReadData)
+					*ReadData = data;
+				break;
+			}
+			if(clocks > 100000) {
+				fprintf(stderr, "no dtack for %08X after %u clocks (state %u)\n", r.Address, clocks, (unsigned)Top->CacheState);
+				exit(2);
+			}
+		}
+
+		Top->AS_L = 1;											// 68k ends the cycle the clock after dtack
+		Top->UDS_L = 1;
+		Top->LDS_L = 1;
+		Top->WE_L = 1;
+		Top->SnoopCycle_H = 0;
+		Clock();
+		return clocks;
+	}
+
+	// reads a 32 bit counter through the cache registers
+	uint32_t ReadCounter(unsigned Offset)
+	{
+		TraceRecord r = {CacheRegBase + Offset, 0, (uint8_t)(TraceRead | TraceSupervisor), 1};
+		uint16_t high = 0, low = 0;
+		Access(r, &high);
+		r.Address += 2;
+		Access(r, &low);
+		return ((uint32_t)high << 16) | low;
+	}
+
+	// writes a 16 bit cache register
+	void WriteRegister(unsigned Offset, uint16_t Value)
+	{
+		TraceRecord r = {CacheRegBase + Offset, Value, (uint8_t)(TraceWrite | TraceSupervisor), 1};
+		Access(r, nullptr);
+	}
+
+	uint16_t ReadRegister(unsigned Offset)
+	{
+		TraceRecord r = {CacheRegBase + Offset, 0, (uint8_t)(TraceRead | TraceSupervisor), 1};
+		uint16_t data = 0;
+		Access(r, &data);
+		return data;
+	}
+
+	uint64_t Clocks = 0;
+	std::unique_ptr<Controller> Top;
+	DramModel Dram;
+
+private:
+	// apply the memories' and Dram's outputs and let the controller's combinational logic settle
+	// (it reads the tag compare results and the memories read what it addresses)
+	void Settle()
+	{
+		const DramOutputs &d = Dram.Outputs();
+		Top->DtackFromDram_L = d.Dtack_L;
+		Top->RAS_Dram_L = d.RAS_L;
+		Top->CAS_Dram_L = d.CAS_L;
+		Top->DataBusInFromDram = d.Data;
+
+		for(int pass = 0; pass < 16; pass++) {
+			Top->eval();
+			unsigned index = Top->Index, word = Top->WordAddress, select = Top->CacheWaySelect_H;
+			uint32_t tag = Top->TagDataOut;
+			unsigned hit = 0, valid = 0;
+			uint16_t data = 0;
+			uint32_t storedTag = 0;
+			for(unsigned way = 0; way < WAYS; way++) {
+				if(Ways[way].Hit(index, tag))
+					hit |= 1u << way;
+				if(Ways[way].IsValid(index))
+					valid |= 1u << way;
+				if(select & (1u << way)) {					// one hot, so or'ing is a mux
+					data |= Ways[way].ReadData(index, word);
+					storedTag |= Ways[way].ReadTag(index);
+				}
+			}
+			if(hit == Top->ValidHit_H && valid == Top->Valid_H && data == Top->DataBusInFromCache &&
+				storedTag == Top->TagDataInFromCache && Lru[index] == Top->LRUBits_In && pass > 0)
+				return;
+			Top->ValidHit_H = hit;
+			Top->Valid_H = valid;
+			Top->DataBusInFromCache = data;
+			Top->TagDataInFromCache = storedTag;
+			Top->LRUBits_In = Lru[index];
+		}
+		fprintf(stderr, "combinational loop between the controller and the cache memories\n");
+		exit(2);
+	}
+
+	// rising edge: the memories and the Dram controller take what the controller drives now
+	void Clock(bool SettleFirst = true)
+	{
+		if(SettleFirst)
+			Settle();
+
+		unsigned index = Top->Index, word = Top->WordAddress;
+		unsigned tagWE = Top->TagCache_WE_L, dataWE = Top->DataCache_WE_L, validWE = Top->ValidBit_WE_L;
+		uint32_t tag = Top->TagDataOut;
+		uint16_t data = Top->DataBusOutToCache;
+		bool validBit = Top->ValidBitOut_H, uds = Top->UDS_DramController_L, lds = Top->LDS_DramController_L;
+		bool lruWE = !Top->LRU_WE_L;
+		uint64_t lruBits = Top->LRUBits_Out;
+		DramInputs dram = {(bool)Top->DramSelectFromCache_L, (bool)Top->AS_DramController_L, (bool)Top->WE_DramController_L,
+								 uds, lds, Top->AddressBusOutToDramController, Top->DataBusOutToDramController};
+
+		Top->Clock = 1;
+		Top->eval();
+
+		for(unsigned way = 0; way < WAYS; way++) {
+			if(!(tagWE & (1u << way)))
+				Ways[way].WriteTag(index, tag);
+			if(!(validWE & (1u << way)))
+				Ways[way].WriteValid(index, validBit);
+			if(!(dataWE & (1u << way)))
+				Ways[way].WriteData(index, word, data, uds, lds);
+		}
+		if(lruWE)
+			Lru[index] = lruBits;
+		Dram.Clock(dram);
+
+		Top->Clock = 0;
+		Top->eval();
+		Clocks++;
+	}
+
+	std::vector<CacheSetModel> Ways;
+	std::vector<uint64_t> Lru;							// up to 64 bits of replacement state (true LRU, 16 ways)
+};
+
+///////////////////////////////////////////////////////////////////////////////////////
+// Replays accesses into the testbench, checking every Dram read against what has been
+// written (by the 68k or a DMA cycle) and totting up the latencies
+///////////////////////////////////////////////////////////////////////////////////////
+
+class Checker {
+public:
+	Checker(Testbench &Tb) : Tb(Tb) {}
+
+	unsigned Run(const TraceRecord &r, bool Snoop = false)
+	{
+		uint16_t data = 0;
+		unsigned clocks = Tb.Access(r, &data, Snoop);
+		uint32_t word = r.Address >> 1;
+		if(TraceIsWrite(r)) {
+			Writes++;
+			WriteClocks += clocks;
+			if(IsDram(r.Address)) {
+				uint16_t old = Expected(r.Address);
+				if((r.Op & TraceOpMask) == TraceWriteByte)
+					Written[word] = (r.Address & 1) ? ((old & 0xFF00) | (r.Data & 0xFF)) : ((old & 0x00FF) | (r.Data << 8));
+				else
+					Written[word] = r.Data;
+			}
+		}
+		else {
+			Reads++;
+			ReadClocks += clocks;
+			if(IsDram(r.Address)) {
+				uint16_t want = Expected(r.Address);
+				if(data != want && Mismatches++ < 10)
+					fprintf(stderr, "read %08X got %04X expected %04X\n", r.Address, data, want);
+			}
+		}
+		return clocks;
+	}
+
+	// what a read of Address should give
+	uint16_t Expected(uint32_t Address) const
+	{
+		auto e = Written.find(Address >> 1);
+		return (e == Written.end()) ? DramInitialWord(Address & ~1u) : e->second;
+	}
+
+	uint64_t Reads = 0, ReadClocks = 0, Writes = 0, WriteClocks = 0, Mismatches = 0;
+
+private:
+	Testbench &Tb;
+	std::unordered_map<uint32_t, uint16_t> Written;
+};
+
+///////////////////////////////////////////////////////////////////////////////////////
+// Directed checks of what a random trace hardly ever exercises: write back eviction,
+// the line commands, locked ways across InvalidateCache and reset, uncached regions,
+// the victim buffer and DMA (snoop) cycles. Lines are put in known ways with the
+// DataWayMask register so the hit and miss counts hold for any replacement policy.
+// Each check uses its own 1M of Dram and leaves nothing dirty behind it
+///////////////////////////////////////////////////////////////////////////////////////
+
+class FeatureChecks {
+public:
+	FeatureChecks(Testbench &Tb) : Tb(Tb), Check(Tb) {}
+
+	unsigned Run()
+	{
+		Begin("write back eviction");				WriteBackEviction();
+		Begin("invalidate and flush lines");		LineCommands();
+		Begin("locked ways");						LockedWays();
+		Begin("uncached region");					UncachedRegion();
+		Begin("victim buffer");						VictimBuffer();
+		Begin("DMA cycles");							Snoop();
+		Begin("DMA cycles on cached lines");		SnoopCachedLines();
+		End();
+		return Failures;
+	}
+
+private:
+	static const uint32_t LineBytes = LINE_WORDS * 2, WayBytes = SETS * LINE_WORDS * 2;
+
+	// line n of the lines mapping to Set in Region (its own 1M of Dram)
+	static uint32_t Line(unsigned Region, unsigned Set, unsigned n)
+	{
+		return DramBase + Region * 0x100000 + n * WayBytes + (Set % SETS) * LineBytes;
+	}
+
+	void Read(uint32_t Address, bool Dma = false)
+	{
+		TraceRecord r = {Address, 0, TraceRead, 1};
+		Check.Run(r, Dma);
+	}
+
+	void Write(uint32_t Address, uint16_t Data, bool Dma = false)
+	{
+		TraceRecord r = {Address, Data, TraceWrite, 1};
+		Check.Run(r, Dma);
+	}
+
+	void WriteRegister32(unsigned Offset, uint32_t Value)
+	{
+		Tb.WriteRegister(Offset, Value >> 16);
+		Tb.WriteRegister(Offset + 2, Value & 0xFFFF);
+	}
+
+	// a line command (CacheCommand register), waiting for it to finish
+	void Command(unsigned Cmd, uint32_t Address = 0, unsigned Lines = 0)
+	{
+		WriteRegister32(0x40, Address);
+		Tb.WriteRegister(0x44, Lines);
+		Tb.WriteRegister(0x46, Cmd);
+		for(int i = 0; Tb.ReadRegister(0x46) & 1; i++) {
+			if(i > 100000) {
+				Fail("command %u never finished", Cmd);
+				return;
+			}
+		}
+	}
+
+	// read from data way k only, so the line goes there on a miss
+	void ReadIntoWay(uint32_t Address, unsigned Way)
+	{
+		Tb.WriteRegister(0x3C, 1u << Way);
+		Read(Address);
+		Tb.WriteRegister(0x3C, 0xFFFF);
+	}
+
+	void Begin(const char *Name)
+	{
+		End();
+		CheckName = Name;
+		Failed = false;
+		StartMismatches = Check.Mismatches;
+	}
+
+	void End()
+	{
+		if(!CheckName)
+			return;
+		if(Check.Mismatches != StartMismatches)
+			Fail("%llu read data errors", (unsigned long long)(Check.Mismatches - StartMismatches));
+		if(!Failed)
+			printf("%-28s ok\n", CheckName);
+		CheckName = nullptr;
+	}
+
+	void Fail(const char *Format, ...)
+	{
+		va_list args;
+		va_start(args, Format);
+		printf("%-28s FAILED: ", CheckName);
+		vprintf(Format, args);
+		printf("\n");
+		va_end(args);
+		Failures += !Failed;
+		Failed = true;
+	}
+
+	void Expect(uint64_t Got, uint64_t Want, const char *What)
+	{
+		if(Got != Want)
+			Fail("%s %llu, expected %llu", What, (unsigned long long)Got, (unsigned long long)Want);
+	}
+
+	// a write reaches Dram when the line is replaced (write back) or from the write buffer (write through)
+	void WriteBackEviction()
+	{
+		uint32_t x = Line(1, 3, 0), y = Line(1, 3, 1);
+		Tb.WriteRegister(0x3C, 1);						// x and y fight over way 0
+		Read(x);
+		uint64_t writes = Tb.Dram.Writes;
+		Write(x + 2, 0x1234);
+		Tb.Idle(100);									// long enough for the write buffer to drain
+		Expect(Tb.Dram.Peek(x + 2), WRITE_BACK ? DramInitialWord(x + 2) : 0x1234, "Dram word before eviction");
+		Read(y);
+		Expect(Tb.Dram.Peek(x + 2), 0x1234, "Dram word after eviction");
+		Expect(Tb.Dram.Writes - writes, WRITE_BACK ? LINE_WORDS : 1, "Dram writes");
+		Read(x + 2);
+		Tb.WriteRegister(0x3C, 0xFFFF);
+	}
+
+	// 8 lines in a row, invalidate the middle 4, then write them all and flush them
+	void LineCommands()
+	{
+		uint32_t first = Line(2, 0, 0);
+		for(unsigned i = 0; i < 8; i++)
+			Read(first + i * LineBytes);
+		uint32_t hits = Tb.ReadCounter(0x00), misses = Tb.ReadCounter(0x04);
+		Command(2, first + 2 * LineBytes, 4);
+		for(unsigned i = 0; i < 8; i++)
+			Read(first + i * LineBytes);
+		Expect(Tb.ReadCounter(0x00) - hits, 4, "read hits after invalidating 4 of 8 lines");
+		Expect(Tb.ReadCounter(0x04) - misses, 4, "read misses after invalidating 4 of 8 lines");
+
+		for(unsigned i = 0; i < 8; i++)
+			Write(first + i * LineBytes, 0x2000 + i);
+		Tb.Idle(100);
+		Command(3, first, 8);
+		for(unsigned i = 0; i < 8; i++)
+			Expect(Tb.Dram.Peek(first + i * LineBytes), 0x2000 + i, "Dram word after flush");
+		misses = Tb.ReadCounter(0x04);
+		for(unsigned i = 0; i < 8; i++)
+			Read(first + i * LineBytes);
+		Expect(Tb.ReadCounter(0x04) - misses, 8, "read misses after flushing 8 lines");
+	}
+
+	// a line in every way of a set, lock all (so all but the top way), then invalidate everything
+	// and reset: only the top way's line misses afterwards
+	void LockedWays()
+	{
+		for(unsigned way = 0; way < WAYS; way++)
+			ReadIntoWay(Line(3, 5, way), way);
+		Tb.WriteRegister(0x48, 0xFFFF);
+		Expect(Tb.ReadRegister(0x48), (1u << (WAYS - 1)) - 1, "LockedWays");
+
+		Command(1);
+		uint32_t hits = Tb.ReadCounter(0x00), misses = Tb.ReadCounter(0x04);
+		for(unsigned way = 0; way < WAYS; way++)
+			Read(Line(3, 5, way));
+		Expect(Tb.ReadCounter(0x00) - hits, WAYS - 1, "read hits after invalidate all");
+		Expect(Tb.ReadCounter(0x04) - misses, 1, "read misses after invalidate all");
+
+		Tb.Idle(100);
+		Tb.Reset();										// clears the counters
+		for(unsigned way = 0; way < WAYS; way++)
+			Read(Line(3, 5, way));
+		Expect(Tb.ReadCounter(0x00), WAYS - 1, "read hits after reset");
+		Expect(Tb.ReadCounter(0x04), 1, "read misses after reset");
+		Tb.WriteRegister(0x48, 0);
+	}
+
+	// a 4K uncached region: reads go to Dram every time and nothing is allocated
+	void UncachedRegion()
+	{
+		uint32_t u = Line(4, 0, 0);
+		WriteRegister32(0x60, u | 1);
+		WriteRegister32(0x64, 0xFFFFF000);
+		uint32_t uncached = Tb.ReadCounter(0x2C), hits = Tb.ReadCounter(0x00), misses = Tb.ReadCounter(0x04);
+		uint64_t dramReads = Tb.Dram.Reads;
+		Read(u);
+		Read(u);
+		Write(u + 4, 0x4444);
+		Read(u + 4);										// waits for the write buffer (write through)
+		Expect(Tb.ReadCounter(0x2C) - uncached, 3, "uncached reads");
+		Expect(Tb.Dram.Reads - dramReads, 3, "Dram reads");
+		Expect(Tb.ReadCounter(0x00) - hits + Tb.ReadCounter(0x04) - misses, 0, "cached reads");
+
+		WriteRegister32(0x60, 0);
+		misses = Tb.ReadCounter(0x04);
+		Read(u);
+		Expect(Tb.ReadCounter(0x04) - misses, 1, "read misses once the region is cached");
+	}
+
+	// two lines taking turns in way 0 swap through the victim buffer, and a write to the one
+	// in the victim buffer throws its copy away
+	void VictimBuffer()
+	{
+		if(VICTIM_ENTRIES == 0) {
+			printf("%-28s skipped (VictimEntries = 0)\n", CheckName);
+			CheckName = nullptr;
+			return;
+		}
+		uint32_t a = Line(5, 7, 0), b = Line(5, 7, 1);
+		Tb.WriteRegister(0x3C, 1);
+		uint32_t victimHits = Tb.ReadCounter(0x80);
+		uint64_t dramReads = Tb.Dram.Reads;
+		Read(a);
+		Read(b);
+		Read(a);
+		Read(b);
+		Expect(Tb.ReadCounter(0x80) - victimHits, 2, "victim hits");
+		Expect(Tb.Dram.Reads - dramReads, 2, "Dram reads");
+		Write(a, 0x5555);
+		Read(a);
+		Tb.WriteRegister(0x3C, 0xFFFF);
+		Tb.Idle(100);
+		Command(3, a, 1);
+	}
+
+	// DMA reads of lines not in the cache go to Dram and allocate nothing, DMA writes reach Dram
+	void Snoop()
+	{
+		uint32_t s = Line(6, 9, 0), t = Line(6, 10, 0);
+		uint32_t uncached = Tb.ReadCounter(0x2C), misses = Tb.ReadCounter(0x04);
+		Read(s, true);
+		Read(s, true);
+		Expect(Tb.ReadCounter(0x2C) - uncached, 2, "DMA reads bypassing the cache");
+		Read(s);
+		Expect(Tb.ReadCounter(0x04) - misses, 1, "68k read misses after DMA reads");
+		Write(t, 0x6666, true);
+		Tb.Idle(100);
+		Expect(Tb.Dram.Peek(t), 0x6666, "Dram word after a DMA write");
+	}
+
+	// a DMA write to a cached line drops it (write through, the 68k's next read misses) or updates
+	// it (write back, the read hits and Dram only has the word after a flush). A DMA read of a word
+	// the 68k has just written finds it still in the write buffer (write through, the read waits
+	// for it) or only in the dirty line (write back, the read is served from the cache)
+	void SnoopCachedLines()
+	{
+		uint32_t c = Line(6, 11, 0), d = Line(6, 12, 0);
+		Read(c);
+		uint32_t invalidations = Tb.ReadCounter(0x0C), hits = Tb.ReadCounter(0x00), misses = Tb.ReadCounter(0x04);
+		Write(c + 2, 0x7777, true);
+		Read(c + 2);
+		if(WRITE_BACK) {
+			Expect(Tb.ReadCounter(0x00) - hits, 1, "68k read hits after a DMA write to a cached line");
+			Expect(Tb.Dram.Peek(c + 2), DramInitialWord(c + 2), "Dram word before flush");
+			Command(3, c, 1);
+			Expect(Tb.Dram.Peek(c + 2), 0x7777, "Dram word after flush");
+		}
+		else {
+			Expect(Tb.ReadCounter(0x0C) - invalidations, 1, "write invalidations for a DMA write to a cached line");
+			Expect(Tb.ReadCounter(0x04) - misses, 1, "68k read misses after a DMA write to a cached line");
+		}
+
+		Write(d + 4, 0x8888);
+		if(WRITE_BACK || WRITE_BUFFER_DEPTH)
+			Expect(Tb.Dram.Peek(d + 4), DramInitialWord(d + 4), "Dram word when the DMA reads it");
+		Read(d + 4, true);
+		if(WRITE_BACK)
+			Command(3, d, 1);
+	}
+
+	Testbench &Tb;
+	Checker Check;
+	const char *CheckName = nullptr;
+	bool Failed = false;
+	uint64_t StartMismatches = 0;
+	unsigned Failures = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char **argv)
+{
+	size_t count = 200000;
+	uint32_t seed = 1;
+	bool stackWorkload = false, checks = false;
+	const char *dtackLogPath = nullptr;
+	DramTiming timing;
+	timing.BurstWords = LINE_WORDS;
+
+	int opt;
+	while((opt = getopt(argc, argv, "n:s:r:l:t:cd:")) != -1) {
+		switch(opt) {
+			case 'n':	count = strtoull(optarg, nullptr, 0); break;
+			case 's':	seed = strtoul(optarg, nullptr, 0); break;
+			case 'r':	timing.RefreshInterval = strtoul(optarg, nullptr, 0); break;
+			case 'l':	timing.CasLatency = strtoul(optarg, nullptr, 0); break;
+			case 't':	stackWorkload = !strcmp(optarg, "stack"); break;
+			case 'c':	checks = true; break;
+			case 'd':	dtackLogPath = optarg; break;
+			default:
+				fprintf(stderr, "usage: %s [-n count] [-s seed] [-r refresh interval] [-l cas latency] [-t loop|stack] [-c] [-d dtack log] [trace]\n", argv[0]);
+				return 1;
+		}
+	}
+	if(timing.CasLatency != 2) {
+		fprintf(stderr, "CAS latency %u: the controller's CASDelay1/2 states only fit a CAS latency of 2\n", timing.CasLatency);
+		return 1;
+	}
+
+	std::unique_ptr<VerilatedContext> context(new VerilatedContext);
+	context->commandArgs(argc, argv);
+	Testbench tb(context.get(), timing);
+
+	if(checks) {
+		printf("Geometry             %u ways x %u sets x %u words, %s, %u victim entries\n", WAYS, SETS, LINE_WORDS,
+				 WRITE_BACK ? "write back" : "write through", VICTIM_ENTRIES);
+		FeatureChecks featureChecks(tb);
+		return featureChecks.Run() ? 1 : 0;
+	}
+
+	TraceFile trace;
+	if(optind < argc) {
+		if(!trace.Open(argv[optind]))
+			return 1;
+	}
+	else
+		trace.Use(stackWorkload ? GenerateStackTrace(count, seed) : GenerateTrace(count, seed));
+
+	FILE *dtackLog = nullptr;
+	if(dtackLogPath && !(dtackLog = fopen(dtackLogPath, "w"))) {
+		perror(dtackLogPath);
+		return 1;
+	}
+
+	Checker check(tb);
+	uint64_t start = tb.Clocks;
+
+	for(const TraceRecord &r : trace) {
+		uint64_t at = tb.Clocks + r.Gap;
+		unsigned clocks = check.Run(r);
+		if(dtackLog)
+			fprintf(dtackLog, "%llu %08X %u\n", (unsigned long long)(at - start), r.Address, clocks);
+	}
+	if(dtackLog)
+		fclose(dtackLog);
+	uint64_t clocks = tb.Clocks - start;
+
+	// the controller's own counters
+	uint32_t readHits = tb.ReadCounter(0x00), readMisses = tb.ReadCounter(0x04);
+	uint32_t burstFillCycles = tb.ReadCounter(0x10), stallCycles = tb.ReadCounter(0x14);
+	uint32_t refreshCollisions = tb.ReadCounter(0x18), writeBufferFull = tb.ReadCounter(0x1C);
+	uint32_t prefetchHits = tb.ReadCounter(0x20), victimHits = tb.ReadCounter(0x80);
+	uint32_t refreshStallCycles = tb.ReadCounter(0x88);
+
+	uint64_t reads = check.Reads, writes = check.Writes, mismatches = check.Mismatches;
+	size_t accesses = reads + writes;
+	printf("Geometry             %u ways x %u sets x %u words\n", WAYS, SETS, LINE_WORDS);
+	printf("Dram                 CAS latency %u, refresh every %u clocks\n", timing.CasLatency, timing.RefreshInterval);
+	printf("Accesses             %zu (%llu reads, %llu writes)\n", accesses, (unsigned long long)reads, (unsigned long long)writes);
+	printf("Clocks               %llu\n", (unsigned long long)clocks);
+	printf("Clocks per access    %.3f\n", accesses ? (double)clocks / accesses : 0.0);
+	printf("Read hit rate        %.2f%% (%u hits, %u misses)\n",
+			 (readHits + readMisses) ? 100.0 * readHits / (readHits + readMisses) : 0.0, readHits, readMisses);
+	printf("Read latency         %.3f clocks\n", reads ? (double)check.ReadClocks / reads : 0.0);
+	printf("Write latency        %.3f clocks\n", writes ? (double)check.WriteClocks / writes : 0.0);
+	printf("Burst fill clocks    %u\n", burstFillCycles);
+	printf("Stall clocks         %u\n", stallCycles);
+	printf("Write buffer full    %u\n", writeBufferFull);
+	printf("Prefetch hits        %u\n", prefetchHits);
+	printf("Victim hits          %u\n", victimHits);
+	printf("Dram reads/writes    %llu / %llu\n", (unsigned long long)tb.Dram.Reads, (unsigned long long)tb.Dram.Writes);
+	printf("Refreshes            %llu (%u collisions, %llu clocks stalled, %u seen by the controller)\n", (unsigned long long)tb.Dram.Refreshes,
+			 refreshCollisions, (unsigned long long)tb.Dram.RefreshStallClocks, refreshStallCycles);
+	printf("Read data errors     %llu\n", (unsigned long long)mismatches);
+	return mismatches ? 1 : 0;
+}
@@ -0,0 +1,229 @@
+///////////////////////////////////////////////////////////////////////////////////////
+// Behavioural models of what AssociativeDramCache.bdf wires around the cache
+// controller: the AssociativeCache_Set memories (one per way), the PseudoLRU_Bits
+// memory, and the Dram controller with its SDRAM
+///////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// where the DE1's SDRAM sits in the 68k's memory map
+const uint32_t DramBase = 0x08000000, DramSize = 0x04000000;		// 64M bytes
+
+inline bool IsDram(uint32_t Address) { return Address - DramBase < DramSize; }
+
+// what a word of Dram holds before anything writes it, so reads can be checked
+inline uint16_t DramInitialWord(uint32_t Address)
+{
+	uint32_t a = Address >> 1;
+	return (uint16_t)(a ^ (a >> 16) ^ 0x5A5A);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////
+// One AssociativeCache_Set: Sets lines of tag (with epoch), valid bit and LineWords
+// words. Reads are asynchronous (the addressed entry is there in the same clock) and
+// writes happen at the rising edge, which is what FastHitMode and the victim buffer
+// capture in the controller rely on. Everything powers up 0, as the FPGA memories do
+///////////////////////////////////////////////////////////////////////////////////////
+
+class CacheSetModel {
+public:
+	CacheSetModel(unsigned Sets, unsigned LineWords) :
+		Tag(Sets, 0), Valid(Sets, 0), Data(Sets * LineWords, 0), LineWords(LineWords) {}
+
+	bool Hit(unsigned Index, uint32_t TagIn) const { return Valid[Index] && Tag[Index] == TagIn; }
+	bool IsValid(unsigned Index) const { return Valid[Index] != 0; }
+	uint32_t ReadTag(unsigned Index) const { return Tag[Index]; }
+	uint16_t ReadData(unsigned Index, unsigned Word) const { return Data[Index * LineWords + Word]; }
+
+	void WriteTag(unsigned Index, uint32_t Value) { Tag[Index] = Value; }
+	void WriteValid(unsigned Index, bool Value) { Valid[Index] = Value; }
+
+	// the data memory's byte enables are the controller's UDS/LDS_DramController_L
+	void WriteData(unsigned Index, unsigned Word, uint16_t Value, bool UDS_L, bool LDS_L)
+	{
+		uint16_t &d = Data[Index * LineWords + Word];
+		if(!UDS_L)
+			d = (d & 0x00FF) | (Value & 0xFF00);
+		if(!LDS_L)
+			d = (d & 0xFF00) | (Value & 0x00FF);
+	}
+
+private:
+	std::vector<uint32_t> Tag;
+	std::vector<uint8_t> Valid;
+	std::vector<uint16_t> Data;
+	unsigned LineWords;
+};
+
+///////////////////////////////////////////////////////////////////////////////////////
+// Dram controller and SDRAM. A select from the cache opens the row (RAS low for a
+// clock), RasToCas clocks later issues the read or write (CAS low, RAS high) to the
+// address the cache is driving then, as the column goes out with the command. A read
+// bursts BurstWords words, wrapping within the line from the word addressed, with the
+// first on DataBusInFromDram CasLatency + 1 clocks after the read command (the
+// controller registers the SDRAM's data, the cache counts this as CASDelay1/2). A
+// write gives dtack from the write command until the select goes away. Every
+// RefreshInterval clocks an auto refresh (RAS and CAS low together) is done as soon as
+// the controller is idle, holding off any access for RefreshClocks
+///////////////////////////////////////////////////////////////////////////////////////
+
+struct DramTiming {
+	unsigned CasLatency = 2;
+	unsigned RasToCas = 2;
+	unsigned Precharge = 2;
+	unsigned RefreshInterval = 390;							// 15.6us at 25MHz (64ms / 4096 rows)
+	unsigned RefreshClocks = 7;
+	unsigned BurstWords = 8;
+};
+
+struct DramInputs {
+	bool Select_L;
+	bool AS_L;
+	bool WE_L;
+	bool UDS_L;
+	bool LDS_L;
+	uint32_t Address;
+	uint16_t Data;
+};
+
+struct DramOutputs {
+	bool Dtack_L = true;
+	bool RAS_L = true;
+	bool CAS_L = true;
+	uint16_t Data = 0;
+};
+
+class DramModel {
+public:
+	explicit DramModel(const DramTiming &Timing) : Timing(Timing) {}
+
+	// what the cache controller sees during this clock
+	const DramOutputs &Outputs() const { return Out; }
+
+	// the controller's signals at the rising edge, works out the outputs for the next clock
+	void Clock(const DramInputs &In)
+	{
+		DramOutputs next;
+		next.Data = Out.Data;
+
+		if(++RefreshTimer >= Timing.RefreshInterval) {
+			RefreshTimer = 0;
+			RefreshDue = true;
+		}
+		if(State == Refreshing && !In.Select_L)
+			RefreshStallClocks++;
+
+		switch(State) {
+			case Idle:
+				if(RefreshDue) {
+					RefreshDue = false;
+					Refreshes++;
+					next.RAS_L = next.CAS_L = false;
+					Counter = Timing.RefreshClocks;
+					State = Refreshing;
+				}
+				else if(!In.Select_L && !In.AS_L && (In.WE_L || !In.UDS_L || !In.LDS_L)) {		// a write waits for its data strobes
+					next.RAS_L = false;								// activate the row
+					Counter = Timing.RasToCas;
+					State = Activating;
+				}
+				break;
+
+			case Activating:
+				if(--Counter == 0) {
+					next.CAS_L = false;
+					Address = In.Address;
+					Write = !In.WE_L;
+					if(Write) {
+						uint16_t &d = Word(Address);
+						if(!In.UDS_L)
+							d = (d & 0x00FF) | (In.Data & 0xFF00);
+						if(!In.LDS_L)
+							d = (d & 0xFF00) | (In.Data & 0x00FF);
+						Writes++;
+						next.Dtack_L = false;
+						State = WriteDtack;
+					}
+					else {
+						Reads++;
+						Beat = -(int)(Timing.CasLatency + 1);
+						State = Bursting;
+					}
+				}
+				break;
+
+			case Bursting:
+				if(++Beat >= 0) {
+					uint32_t line = Address & ~(uint32_t)(Timing.BurstWords * 2 - 1);
+					uint32_t word = ((Address >> 1) + Beat) & (Timing.BurstWords - 1);
+					next.Data = Word(line + word * 2);
+					if(Beat == (int)Timing.BurstWords - 1)
+						State = WaitForDeselect;
+				}
+				break;
+
+			case WriteDtack:
+				next.Dtack_L = false;
+				if(In.Select_L || In.AS_L) {
+					next.Dtack_L = true;
+					Counter = Timing.Precharge;
+					State = Precharging;
+				}
+				break;
+
+			case WaitForDeselect:
+				if(In.Select_L || In.AS_L) {
+					Counter = Timing.Precharge;
+					State = Precharging;
+				}
+				break;
+
+			case Precharging:
+			case Refreshing:
+				if(Counter <= 1)
+					State = Idle;
+				else
+					Counter--;
+				break;
+		}
+		Out = next;
+	}
+
+	// the memory behind the controller, for checking what the 68k reads
+	uint16_t Peek(uint32_t Address) const
+	{
+		auto w = Memory.find(Address >> 1);
+		return (w == Memory.end()) ? DramInitialWord(Address & ~1u) : w->second;
+	}
+
+	uint64_t Reads = 0;
+	uint64_t Writes = 0;
+	uint64_t Refreshes = 0;
+	uint64_t RefreshStallClocks = 0;							// clocks the cache had the Dram selected while it refreshed
+
+private:
+	uint16_t &Word(uint32_t Address)
+	{
+		auto w = Memory.find(Address >> 1);
+		if(w == Memory.end())
+			w = Memory.emplace(Address >> 1, DramInitialWord(Address & ~1u)).first;
+		return w->second;
+	}
+
+	enum DramState { Idle, Activating, Bursting, WriteDtack, WaitForDeselect, Precharging, Refreshing };
+
+	DramTiming Timing;
+	DramOutputs Out;
+	DramState State = Idle;
+	unsigned Counter = 0;
+	int Beat = 0;
+	bool Write = false;
+	uint32_t Address = 0;
+	unsigned RefreshTimer = 0;
+	bool RefreshDue = false;
+	std::unordered_map<uint32_t, uint16_t> Memory;
+};
@@ -0,0 +1,337 @@
+///////////////////////////////////////////////////////////////////////////////////////
+// 68k bus traces, shared by the Verilator harness (CacheTestbench) and the software
+// cache model (CacheSim)
+//
+// Text traces have one access per line, '#' starts a comment:
+//
+//		<op> <hex address> [<hex data>] [+<idle clocks before the access>]
+//
+//		R = data read, F = program fetch, W = word write, B = byte write (address bit 0
+//		picks the byte, data is the byte value). Lower case ops are supervisor accesses
+//		(FC = 1xx), upper case are user (FC = 001 data, 010 program)
+//
+// Binary traces are TraceMagic followed by TraceRecords (little endian) and are
+// memory mapped rather than read, so they can be many gigabytes. CacheSim -c converts
+// a text trace to binary
+///////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+enum TraceOp : uint8_t {
+	TraceRead = 0,
+	TraceFetch = 1,
+	TraceWrite = 2,
+	TraceWriteByte = 3
+};
+
+const uint8_t TraceOpMask = 0x03;
+const uint8_t TraceSupervisor = 0x80;				// or'd into Op for a supervisor access
+
+struct TraceRecord {
+	uint32_t Address;
+	uint16_t Data;											// write data (a byte write uses the low byte)
+	uint8_t Op;
+	uint8_t Gap;											// clocks the 68k spends between the previous access and this one
+};
+static_assert(sizeof(TraceRecord) == 8, "TraceRecord must pack to 8 bytes");
+
+static const char TraceMagic[8] = {'6', '8', 'K', 'T', 'R', 'C', '1', 0};
+
+inline bool TraceIsWrite(const TraceRecord &r) { return (r.Op & TraceOpMask) >= TraceWrite; }
+
+// function code the TG68 would drive for the access
+inline unsigned TraceFunctionCode(const TraceRecord &r)
+{
+	unsigned fc = ((r.Op & TraceOpMask) == TraceFetch) ? 2 : 1;
+	return (r.Op & TraceSupervisor) ? (fc | 4) : fc;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////
+// A trace in memory: binary files are mapped, text files parsed into a vector
+///////////////////////////////////////////////////////////////////////////////////////
+
+class TraceFile {
+public:
+	TraceFile() {}
+	~TraceFile() { Close(); }
+	TraceFile(const TraceFile &) = delete;
+	TraceFile &operator=(const TraceFile &) = delete;
+
+	bool Open(const char *Path)
+	{
+		Close();
+		int fd = open(Path, O_RDONLY);
+		if(fd < 0) {
+			perror(Path);
+			return false;
+		}
+		struct stat st;
+		char magic[sizeof(TraceMagic)] = {0};
+		if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(magic) || read(fd, magic, sizeof(magic)) != (ssize_t)sizeof(magic) ||
+			memcmp(magic, TraceMagic, sizeof(magic)) != 0) {
+			close(fd);
+			return ParseText(Path);
+		}
+
+		MapLength = st.st_size;
+		void *map = mmap(nullptr, MapLength, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if(map == MAP_FAILED) {
+			perror(Path);
+			MapLength = 0;
+			return false;
+		}
+		madvise(map, MapLength, MADV_SEQUENTIAL);		// read once, front to back
+		Map = map;
+		Records = (const TraceRecord *)((const char *)map + sizeof(TraceMagic));
+		Count = (MapLength - sizeof(TraceMagic)) / sizeof(TraceRecord);
+		return true;
+	}
+
+	void Use(std::vector<TraceRecord> &&Generated)
+	{
+		Close();
+		Text = std::move(Generated);
+		Records = Text.data();
+		Count = Text.size();
+	}
+
+	void Close()
+	{
+		if(Map)
+			munmap(Map, MapLength);
+		Map = nullptr;
+		MapLength = 0;
+		Text.clear();
+		Records = nullptr;
+		Count = 0;
+	}
+
+	const TraceRecord *begin() const { return Records; }
+	const TraceRecord *end() const { return Records + Count; }
+	size_t size() const { return Count; }
+
+private:
+	bool ParseText(const char *Path)
+	{
+		FILE *f = fopen(Path, "r");
+		if(f == nullptr) {
+			perror(Path);
+			return false;
+		}
+		char line[256];
+		unsigned lineNumber = 0;
+		while(fgets(line, sizeof(line), f)) {
+			lineNumber++;
+			char *p = line;
+			while(*p == ' ' || *p == '\t')
+				p++;
+			if(*p == '#' || *p == '\n' || *p == '\r' || *p == 0)
+				continue;
+
+			TraceRecord r = {0, 0, 0, 0};
+			char op = *p++;
+			switch(op) {
+				case 'R': case 'r':	r.Op = TraceRead; break;
+				case 'F': case 'f':	r.Op = TraceFetch; break;
+				case 'W': case 'w':	r.Op = TraceWrite; break;
+				case 'B': case 'b':	r.Op = TraceWriteByte; break;
+				default:
+					fprintf(stderr, "%s:%u: unknown op '%c'\n", Path, lineNumber, op);
+					fclose(f);
+					return false;
+			}
+			if(op >= 'a')
+				r.Op |= TraceSupervisor;
+
+			char *next;
+			r.Address = (uint32_t)strtoul(p, &next, 16);
+			if(next == p) {
+				fprintf(stderr, "%s:%u: missing address\n", Path, lineNumber);
+				fclose(f);
+				return false;
+			}
+			p = next;
+			while(*p == ' ' || *p == '\t')
+				p++;
+			if(*p != '+' && *p != '#' && *p != '\n' && *p != '\r' && *p != 0) {
+				r.Data = (uint16_t)strtoul(p, &next, 16);
+				p = next;
+				while(*p == ' ' || *p == '\t')
+					p++;
+			}
+			if(*p == '+') {
+				unsigned long gap = strtoul(p + 1, nullptr, 10);
+				r.Gap = (gap > 255) ? 255 : (uint8_t)gap;
+			}
+			Text.push_back(r);
+		}
+		fclose(f);
+		Records = Text.data();
+		Count = Text.size();
+		return true;
+	}
+
+	void *Map = nullptr;
+	size_t MapLength = 0;
+	std::vector<TraceRecord> Text;
+	const TraceRecord *Records = nullptr;
+	size_t Count = 0;
+};
+
+inline bool WriteBinaryTrace(const char *Path, const TraceRecord *Records, size_t Count)
+{
+	FILE *f = fopen(Path, "wb");
+	if(f == nullptr) {
+		perror(Path);
+		return false;
+	}
+	bool ok = fwrite(TraceMagic, sizeof(TraceMagic), 1, f) == 1 &&
+				 fwrite(Records, sizeof(TraceRecord), Count, f) == Count;
+	ok = (fclose(f) == 0) && ok;
+	if(!ok)
+		fprintf(stderr, "%s: write failed\n", Path);
+	return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////
+// Synthetic workload for when there is no captured trace: a program looping over a
+// couple of K of code with calls to a few functions, sweeping a 32K data array, with
+// stack traffic and about 1 in 6 accesses a write, plus supervisor timer ISRs. All in
+// Dram (0x08000000 up) and always the same for the same Seed
+///////////////////////////////////////////////////////////////////////////////////////
+
+inline std::vector<TraceRecord> GenerateTrace(size_t Count, uint32_t Seed = 1)
+{
+	const uint32_t Code = 0x08000000, Functions = 0x08004000, Isr = 0x08006000;
+	const uint32_t Array = 0x08020000, Stack = 0x0803F000;
+
+	std::vector<TraceRecord> trace;
+	trace.reserve(Count);
+	uint32_t random = Seed ? Seed : 1;
+	auto Next = [&random]() { random ^= random << 13; random ^= random >> 17; random ^= random << 5; return random; };
+
+	uint32_t pc = Code, arrayIndex = 0, sp = Stack;
+	unsigned inFunction = 0, inIsr = 0;
+	uint32_t savedPc = 0, isrReturn = 0;
+	for(size_t i = 0; i < Count; i++) {
+		TraceRecord r = {0, 0, TraceFetch, 0};
+		uint32_t roll = Next() % 100;
+		if(inIsr == 0 && i % 5000 == 4999) {						// timer tick
+			inIsr = 60;
+			isrReturn = pc;
+			pc = Isr;
+		}
+
+		if(roll < 55) {													// instruction fetch
+			r.Op = TraceFetch;
+			r.Address = pc;
+			pc += 2;
+			if(inIsr == 0 && inFunction == 0 && pc >= Code + 0x800)
+				pc = Code;
+			if(inIsr == 0 && inFunction == 0 && Next() % 64 == 0) {
+				inFunction = 40 + Next() % 80;
+				savedPc = pc;
+				pc = Functions + (Next() % 8) * 0x200;
+			}
+		}
+		else if(roll < 75) {												// array read
+			r.Op = TraceRead;
+			r.Address = Array + (arrayIndex & 0x7FFE);
+			arrayIndex += 2;
+		}
+		else if(roll < 83) {												// stack read
+			r.Op = TraceRead;
+			r.Address = sp + (Next() % 32) * 2;
+		}
+		else if(roll < 91) {												// stack write
+			r.Op = TraceWrite;
+			r.Address = sp + (Next() % 32) * 2;
+			r.Data = (uint16_t)Next();
+		}
+		else if(roll < 97) {												// array write
+			r.Op = TraceWrite;
+			r.Address = Array + ((arrayIndex - 64) & 0x7FFE);
+			r.Data = (uint16_t)Next();
+		}
+		else {																// byte write
+			r.Op = TraceWriteByte;
+			r.Address = Array + 0x8000 + (Next() % 256);
+			r.Data = (uint16_t)(Next() & 0xFF);
+		}
+		r.Gap = (uint8_t)(Next() % 3);
+
+		if(inIsr) {
+			r.Op |= TraceSupervisor;
+			if(--inIsr == 0)
+				pc = isrReturn;
+		}
+		else if(inFunction && --inFunction == 0)
+			pc = savedPc;
+		trace.push_back(r);
+	}
+	return trace;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////
+// Stack heavy synthetic workload: recursive code calling and returning at random,
+// each call pushing a return address and 6 saved registers and using 8 words of
+// locals, up to MaxDepth frames (10K of stack) deep, so most data accesses are stack
+// words written and read back soon after. About 1 in 4 accesses is a write
+///////////////////////////////////////////////////////////////////////////////////////
+
+inline std::vector<TraceRecord> GenerateStackTrace(size_t Count, uint32_t Seed = 1)
+{
+	const uint32_t Code = 0x08000000, Stack = 0x0803F000;
+	const unsigned FrameBytes = 40, MaxDepth = 256;
+
+	std::vector<TraceRecord> trace;
+	trace.reserve(Count);
+	uint32_t random = Seed ? Seed : 1;
+	auto Next = [&random]() { random ^= random << 13; random ^= random >> 17; random ^= random << 5; return random; };
+	auto Add = [&](uint8_t Op, uint32_t Address) {
+		if(trace.size() < Count)
+			trace.push_back({Address, (uint16_t)Next(), Op, (uint8_t)(Next() % 3)});
+	};
+
+	uint32_t pc = Code, sp = Stack;
+	unsigned depth = 0;
+	while(trace.size() < Count) {
+		for(unsigned n = 2 + Next() % 6; n > 0; n--) {			// a few instructions of the function
+			Add(TraceFetch, pc);
+			pc = Code + ((pc + 2 - Code) & 0xFFF);
+		}
+		if(depth)																// a local
+			Add((Next() % 3) ? TraceRead : TraceWrite, sp + 24 + (Next() % 8) * 2);
+
+		if(depth < MaxDepth && (depth == 0 || Next() % 2)) {		// call: JSR pushes the return address, MOVEM the registers
+			sp -= FrameBytes;
+			Add(TraceWrite, sp + 22);
+			Add(TraceWrite, sp + 20);
+			for(unsigned w = 0; w < 6; w++)
+				Add(TraceWrite, sp + 8 + w * 2);
+			depth++;
+		}
+		else {																// return: MOVEM the registers back, RTS
+			for(unsigned w = 0; w < 6; w++)
+				Add(TraceRead, sp + 8 + w * 2);
+			Add(TraceRead, sp + 20);
+			Add(TraceRead, sp + 22);
+			sp += FrameBytes;
+			depth--;
+		}
+	}
+	return trace;
+}